@@ -10,8 +10,17 @@
 
 using namespace std;
 
-void
-Controller::controller() {
+/*
+	rtv's decision for one robot. All it needs of the seen pucks is how many
+	there are, whether any is in pickup range, and the bearing to the closest
+	one not held (0 if none)
+*/
+static inline void
+rtv_decide(const Home *home, const double x, const double y, const double a,
+	const bool has_puck, const int seen_puck_count, const bool puck_in_range,
+	const double closest_bearing, double *last_x, double *last_y,
+	double *v, double *w, int *puck_action) {
+
 	double heading_error(0.0);
 	// distance and angle to home
 	const double dx( antix::WrapDistance( home->x - x ) );
@@ -19,10 +28,6 @@ Controller::controller() {
 	const double da( antix::fast_atan2( dy, dx ) );
 	const double dist( hypot( dx, dy ) );
 
-	if (collided) {
-		//cout << "I collided!" << endl;
-	}
-
 	// if this robot is holding a puck
 	if (has_puck) {
 		// turn towards home
@@ -30,36 +35,27 @@ Controller::controller() {
 
 		// if the robot is some random distance inside home, drop puck
 		if (dist < drand48() * home->r) {
-			puck_action = PUCK_ACTION_DROP;
+			*puck_action = PUCK_ACTION_DROP;
 		}
 
 	// not holding a puck
 	} else {
 		// if we're away from home and see puck(s)
-		if (dist > home->r && seen_pucks.size() > 0) {
-			double closest_range(1e9);
-			// Look at all the pucks we can see
-			vector<CSeePuck>::iterator end = seen_pucks.end();
-			for (vector<CSeePuck>::const_iterator it = seen_pucks.begin(); it != end; it++) {
-				// If one is within pickup distance, try to pick it up
-				if (it->range < Robot::pickup_range && !has_puck) {
-					// remember this location
-					last_x = x;
-					last_y = y;
-					puck_action = PUCK_ACTION_PICKUP;
-				}
-
-				// Otherwise see if its the closest we've seen yet
-				if (it->range < closest_range && !it->held) {
-					heading_error = it->bearing;
-					closest_range = it->range;
-				}
+		if (dist > home->r && seen_puck_count > 0) {
+			// If one is within pickup distance, try to pick it up
+			if (puck_in_range) {
+				// remember this location
+				*last_x = x;
+				*last_y = y;
+				*puck_action = PUCK_ACTION_PICKUP;
 			}
+			// and head for the closest
+			heading_error = closest_bearing;
 
 		// we don't see any pucks
 		} else {
-			const double lx( antix::WrapDistance( last_x - x ) );
-			const double ly( antix::WrapDistance( last_y - y ) );
+			const double lx( antix::WrapDistance( *last_x - x ) );
+			const double ly( antix::WrapDistance( *last_y - y ) );
 
 			// go towards last place a puck was picked up (or attempted pick up in
 			// the case of this version
@@ -67,10 +63,10 @@ Controller::controller() {
 
 			// if the robot is at the location of last attempted puck, choose random
 			if ( hypot( lx, ly ) < 0.05 ) {
-				last_x += drand48() * 1.0 - 0.5;
-				last_y += drand48() * 1.0 - 0.5;
-				last_x = antix::DistanceNormalize( last_x );
-				last_y = antix::DistanceNormalize( last_y );
+				*last_x += drand48() * 1.0 - 0.5;
+				*last_y += drand48() * 1.0 - 0.5;
+				*last_x = antix::DistanceNormalize( *last_x );
+				*last_y = antix::DistanceNormalize( *last_y );
 			}
 		}
 	// done not holding puck case
@@ -78,11 +74,65 @@ Controller::controller() {
 
 	// check if the robot is pointing in correct direction
 	if ( fabs(heading_error) < 0.1 ) {
-		v = 0.005;
-		w = 0.0;
+		*v = 0.005;
+		*w = 0.0;
 	} else {
-		v = 0.001;
-		w = 0.2 * heading_error;
+		*v = 0.001;
+		*w = 0.2 * heading_error;
+	}
+}
+
+void
+Controller::controller() {
+	if (collided) {
+		//cout << "I collided!" << endl;
+	}
+
+	// Look at all the pucks we can see
+	bool puck_in_range = false;
+	double closest_range(1e9);
+	double closest_bearing(0.0);
+	vector<CSeePuck>::iterator end = seen_pucks.end();
+	for (vector<CSeePuck>::const_iterator it = seen_pucks.begin(); it != end; it++) {
+		if (it->range < Robot::pickup_range)
+			puck_in_range = true;
+
+		// see if its the closest we've seen yet
+		if (it->range < closest_range && !it->held) {
+			closest_bearing = it->bearing;
+			closest_range = it->range;
+		}
+	}
+
+	rtv_decide(home, x, y, a, has_puck, seen_pucks.size(), puck_in_range,
+		closest_bearing, &last_x, &last_y, &v, &w, &puck_action);
+}
+
+/*
+	The same decisions for a whole batch, reading the seen pucks straight
+	from the batch's arrays
+*/
+extern "C" void
+batch_controller(Controller *ctlr, ControllerBatch *batch) {
+	for (int i = 0; i < batch->size; i++) {
+		bool puck_in_range = false;
+		double closest_range(1e9);
+		double closest_bearing(0.0);
+		const int pucks_end = batch->puck_start[i + 1];
+		for (int j = batch->puck_start[i]; j < pucks_end; j++) {
+			if (batch->puck_range[j] < Robot::pickup_range)
+				puck_in_range = true;
+
+			if (batch->puck_range[j] < closest_range && !batch->puck_held[j]) {
+				closest_bearing = batch->puck_bearing[j];
+				closest_range = batch->puck_range[j];
+			}
+		}
+
+		rtv_decide(batch->home, batch->x[i], batch->y[i], batch->a[i],
+			batch->has_puck[i], pucks_end - batch->puck_start[i], puck_in_range,
+			closest_bearing, &batch->last_x[i], &batch->last_y[i],
+			&batch->v[i], &batch->w[i], &batch->puck_action[i]);
 	}
 }
 
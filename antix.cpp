@@ -13,8 +13,11 @@
 #include <iostream>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/time.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <new>
 #include <set>
 #include <algorithm>
 
@@ -38,6 +41,116 @@
 
 #define MULTI_NODES_MACHINE
 
+// Keep each robot's memory (ints/doubles, last_x/last_y) in the client process
+// instead of passing it node -> client -> node every turn (and node -> node on
+// migration). Only robot identity then crosses the wire.
+// NOTE: with one client per team per node, a robot that migrates to another
+// node starts with fresh memory in that node's client. Run one client per team
+// across all nodes (several node IPC ids) to keep memory across migration
+#define CLIENT_MEMORY 0
+
+// Send only the robot fields that changed since we last told the client,
+// and flag seen lists that are the same as last turn. Client keeps a mirror
+#define SENSE_DELTA 0
+// Every this many turns send everything so clients can resync
+#define SENSE_KEYFRAME_TURNS 50
+
+// Nodes combine their done messages (and scores) up a tree with
+// BARRIER_FANOUT children per node, so that only node 0 reports to master
+#define TREE_BARRIER 0
+#define BARRIER_FANOUT 4
+// Children push done messages to this port offset from their parent's
+// neighbour port
+#define BARRIER_PORT_OFFSET 2000
+
+// No global turn barrier: a node begins its next turn as soon as the border
+// handshake with its neighbours is done, which keeps neighbours within a turn
+// of each other. Master only collects scores (with the node's turn) every
+// TURNS_SEND_SCORE turns, and stops all nodes at an agreed future turn
+#define NEIGHBOUR_SYNC 0
+
+// Update our left critical section robots while our request to the left
+// neighbour is in flight, assuming its ghosts are where it last told us.
+// When its reply disagrees, undo and redo from the first robot affected
+#define SPECULATIVE_BORDER 0
+
+// If non-zero, a node waits at most this many milliseconds each turn for its
+// clients. Teams that are late keep moving with their previous v/w, their
+// commands are applied without puck actions when they arrive, and misses
+// are counted per team
+#define CLIENT_DEADLINE_MS 0
+
+// Robots that are not moving or turning skip pose updates, and robots whose
+// pose and view cells have not changed reuse last turn's sense results
+#define SKIP_IDLE 1
+
+// Keep for each robot the robots & pucks within vision_range + skin and sense
+// only those. Lists are rebuilt once anything has moved more than half the
+// skin, or robots / pucks were added or removed. Skin is a fraction of
+// vision_range
+#define SENSE_NEIGHBOUR_LISTS 0
+#define SENSE_SKIN 0.5
+
+// Find what robots see of each other by looking at each pair of robots in
+// neighbouring cells once, rather than each robot scanning its view
+#define SENSE_SYMMETRIC_PAIRS 0
+
+// Before scanning a robot's view cells, find which lie wholly outside its
+// vision sector (skipped) or wholly inside (range & fov tests skipped).
+// Margin is in radians and must be at least fast_atan2()'s error
+#define SENSE_CONE_CELLS 1
+#define SENSE_CONE_MARGIN 0.01
+
+// Keep bitmaps of which sense matrix cells hold robots / pucks so scans over
+// a robot's view skip empty cells
+#define SENSE_OCCUPANCY 1
+
+// Most cells the vision matrix may have, whatever cells per vision range
+// was asked for. When the master asks nodes to choose cells per vision range
+// they time sensing this many times with each of a few sizes
+#define MAX_VISION_CELLS (1 << 22)
+#define VISION_CALIBRATION_RUNS 3
+
+// Every this many turns sort the node's robots & pucks along a Morton curve
+// over their vision cells so loops over them go through the matrices in
+// spatial order. Changes the order robots are moved in. 0: never
+#define SPATIAL_REORDER_TURNS 0
+
+// Allocate Robots from blocks of this many, each starting on a cache line
+#define ROBOT_POOL 1
+#define ROBOT_POOL_BLOCK 4096
+#define CACHE_LINE 64
+
+// Store robot & puck positions and headings as floats rather than doubles.
+// Messages still carry doubles. tests/test_precision.cpp compares the two
+#define FLOAT_COORDS 0
+
+// Work out where all robots outside critical sections would move in one pass
+// over arrays (antix::propose_poses(), which the compiler can vectorise)
+// before moving them one by one. Same results as proposing robot by robot
+#define BATCH_POSES 1
+
+// The collision matrix keeps, for each square of this many by this many
+// collision cells, a list of the robots in it. Collision cells are still
+// 2 * robot_radius and hold at most one robot; the squares save memory, and
+// the cells around a robot lie in at most 2 x 2 squares. At least 2
+#define COLLISION_BUCKET_CELLS 2
+
+// Motion primitives (control_message commands): turn speed per radian of
+// heading error, and heading error under which the robot drives straight.
+// While turning the robot slows to 1/PRIMITIVE_TURN_SLOWDOWN of its speed
+#define PRIMITIVE_TURN_GAIN 0.2
+#define PRIMITIVE_HEADING_TOLERANCE 0.1
+#define PRIMITIVE_TURN_SLOWDOWN 5
+// Most turns a primitive runs before the robot is stopped and handed back to
+// its client, so a GOTO or HEADING_UNTIL_COLLISION that is never done can't
+// keep a robot from its controller
+#define PRIMITIVE_MAX_TURNS 1000
+
+#if TREE_BARRIER && NEIGHBOUR_SYNC
+#error TREE_BARRIER and NEIGHBOUR_SYNC cannot both be used
+#endif
+
 // Debug everything
 #define DEBUG 0
 
@@ -76,6 +189,52 @@ typedef struct {
 	bounds_t x, y;
 } bbox_t;
 
+// type of stored positions & headings
+#if FLOAT_COORDS
+typedef float coord_t;
+#else
+typedef double coord_t;
+#endif
+
+/*
+	A square grid over the world (the vision and collision matrices): cells
+	per side and cell size, with its reciprocal so finding a cell is a
+	multiply. Wrapping is a mask when cells is a power of two, else two
+	compares
+*/
+class GridGeometry {
+public:
+	unsigned int cells;
+	double cell_size;
+	double inverse_cell_size;
+	bool pow2;
+
+	void
+	set(double world_size, unsigned int cells) {
+		this->cells = cells;
+		cell_size = world_size / (double) cells;
+		inverse_cell_size = (double) cells / world_size;
+		pow2 = (cells & (cells - 1)) == 0;
+	}
+
+	// cell along an axis, not wrapped
+	inline int
+	cell(double v) const {
+		return (int) floor(v * inverse_cell_size);
+	}
+
+	// c may be up to one grid outside the grid
+	inline unsigned int
+	wrap(int c) const {
+		if (pow2)
+			return c & (cells - 1);
+		assert( c >= -(int) cells && c < 2 * (int) cells );
+		c += (c < 0) * (int) cells;
+		c -= (c >= (int) cells) * (int) cells;
+		return c;
+	}
+};
+
 class antix {
 public:
 	static double offset_size;
@@ -94,6 +253,10 @@ public:
 
 	static unsigned int cmatrix_width;
 
+	// geometry of the vision (matrix_height square) & collision matrices
+	static GridGeometry vision_grid;
+	static GridGeometry collision_grid;
+
 	/*
 		Take a host and a port, return c_str
 	*/
@@ -119,6 +282,16 @@ public:
 		usleep(ms * 1e3);
 	}
 
+	/*
+		wall clock time in milliseconds
+	*/
+	static long
+	now_ms() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+	}
+
 	static void
 	check_zmq_version() {
 		int major, minor, patch;
@@ -459,6 +632,12 @@ public:
 	*/
 	static double
 	DistanceNormalize(double d) {
+		// usually within a world of the range: one step without branches
+		d += (d < 0) * world_size;
+		d -= (d > world_size) * world_size;
+		if ( d >= 0 && d <= world_size )
+			return d;
+
 		while ( d < 0 )
 			d += world_size;
 		while ( d > world_size )
@@ -466,12 +645,61 @@ public:
 		return d; 
 	}
 
+	/*
+		Where a robot at x, y with heading a moves to at speeds v, w, before
+		collisions. T is the type positions are stored in
+	*/
+	template <class T>
+	static inline void
+	propose_pose(const T x, const T y, const T a, const double v, const double w, T &new_x, T &new_y, T &new_a) {
+		new_x = DistanceNormalize(x + v * fast_cos(a));
+		new_y = DistanceNormalize(y + v * fast_sin(a));
+		new_a = AngleNormalize(a + w);
+	}
+
+	/*
+		propose_pose() for n robots, over arrays. Loop body has no branches
+		or calls so it can be vectorised: normalising takes one step, and any
+		pose that needs more (speeds over a world / turn) is redone by
+		propose_pose() after. tests/test_batch_poses.cpp compares the two
+	*/
+	static void
+	propose_poses(const unsigned int n, const double *x, const double *y, const double *a, const double *v, const double *w,
+		double * __restrict__ new_x, double * __restrict__ new_y, double * __restrict__ new_a) {
+		const double ws = world_size;
+		for (unsigned int i = 0; i < n; i++) {
+			double nx = x[i] + v[i] * fast_cos(a[i]);
+			double ny = y[i] + v[i] * fast_sin(a[i]);
+			double na = a[i] + w[i];
+			nx += (nx < 0) * ws;
+			nx -= (nx > ws) * ws;
+			ny += (ny < 0) * ws;
+			ny -= (ny > ws) * ws;
+			na += (na < -M_PI) * 2.0*M_PI;
+			na -= (na > M_PI) * 2.0*M_PI;
+			new_x[i] = nx;
+			new_y[i] = ny;
+			new_a[i] = na;
+		}
+
+		for (unsigned int i = 0; i < n; i++) {
+			if (new_x[i] < 0 || new_x[i] > ws || new_y[i] < 0 || new_y[i] > ws || fabs(new_a[i]) > M_PI)
+				propose_pose<double>(x[i], y[i], a[i], v[i], w[i], new_x[i], new_y[i], new_a[i]);
+		}
+	}
+
 	/*
 		Normalize an angle to within +/- M_PI
 		from rtv's Antix
 	*/
 	static double
 	AngleNormalize(double a) {
+		// usually within a turn of the range: one step without branches
+		a += (a < -M_PI) * 2.0*M_PI;
+		a -= (a > M_PI) * 2.0*M_PI;
+		if ( fabs(a) <= M_PI )
+			return a;
+
 		while ( a < -M_PI )
 			a += 2.0*M_PI;
 		while ( a >  M_PI )
@@ -479,46 +707,53 @@ public:
 		return a;
 	}
 
+	/*
+		Position of cell x, y along a Morton (Z-order) curve: bits of x & y
+		interleaved
+	*/
+	static inline uint64_t
+	morton(uint32_t x, uint32_t y) {
+		uint64_t key = 0;
+		for (int i = 0; i < 32; i++) {
+			key |= (uint64_t) ((x >> i) & 1) << (2*i);
+			key |= (uint64_t) ((y >> i) & 1) << (2*i + 1);
+		}
+		return key;
+	}
+
+	/*
+		Set the cells per side of the vision / collision matrices
+	*/
+	static void
+	set_vision_grid(unsigned int height) {
+		matrix_height = height;
+		vision_grid.set(world_size, height);
+	}
+
+	static void
+	set_collision_grid(unsigned int width) {
+		cmatrix_width = width;
+		collision_grid.set(world_size, width);
+	}
+
 	/*
 		these cell methods similar/same to those from rtv's antix
 	*/
 
+	// we don't wrap around x
 	static inline unsigned int
 	Cell_x(double x) {
-		const double d = world_size / (double) matrix_height;
-
-		// wraparound
-		// we don't wrap around x?
-		/*
-		while (x > world_size)
-			x -= world_size;
-		while (x < 0)
-			x += world_size;
-		*/
-		
-		return floor(x / d);
+		return vision_grid.cell(x);
 	}
 
 	static inline unsigned int
-	Cell_y(double x) {
-		const double d = world_size / (double) matrix_height;
-
-		// wraparound
-		while (x > world_size)
-			x -= world_size;
-		while (x < 0)
-			x += world_size;
-		
-		return floor(x / d);
+	Cell_y(double y) {
+		return vision_grid.wrap( vision_grid.cell(y) );
 	}
 
 	static inline unsigned int
-	CellWrap(int x) {
-		while (x >= (int) matrix_height)
-			x -= matrix_height;
-		while (x < 0)
-			x += matrix_height;
-		return x;
+	CellWrap(int y) {
+		return vision_grid.wrap(y);
 	}
 
 	static inline unsigned int
@@ -534,55 +769,26 @@ public:
 	// used for bounding boxes
 	static inline unsigned int
 	CellNoWrap_x (double x) {
-		//const double d = offset_size / (double) matrix_width;
-		const double d = world_size / (double) matrix_height;
-
 		// XXX
-		if (x < 0)
-			x = -x;
-
-		unsigned int i = floor(x / d);
-		//cout << "CellNoWrap_x got x " << x << " d " << d << " floor: " << i << endl;
-
-		return floor( x / d );
+		return vision_grid.cell( fabs(x) );
 	}
 
 	static inline unsigned int
-	CellNoWrap_y (double x) {
-		const double d = world_size / (double) matrix_height;
-		
-		return floor(x / d);
+	CellNoWrap_y (double y) {
+		return vision_grid.cell(y);
 	}
 
 	/*
-		Collision cell functions
+		Collision cell functions. Both axes wrap
 	*/
 	static inline unsigned int
 	CCell_x(double x) {
-		const double d = world_size / (double) cmatrix_width;
-
-		// wraparound
-		// XXX don't wrap around x?
-		while (x > world_size)
-			x -= world_size;
-
-		while (x < 0)
-			x += world_size;
-		
-		return floor(x / d);
+		return collision_grid.wrap( collision_grid.cell(x) );
 	}
 
 	static inline unsigned int
-	CCell_y(double x) {
-		const double d = world_size / (double) cmatrix_width;
-
-		// wraparound
-		while (x > world_size)
-			x -= world_size;
-		while (x < 0)
-			x += world_size;
-
-		return floor(x / d);
+	CCell_y(double y) {
+		return collision_grid.wrap( collision_grid.cell(y) );
 	}
 
 	static inline unsigned int
@@ -642,9 +848,7 @@ public:
 		const double P = 0.225;
 
 		x = x + M_PI/2;
-		if (x > M_PI) {
-			x -= 2 * M_PI;
-		}
+		x -= (x > M_PI) * 2 * M_PI;
 
 		double y = B * x + C * x * fabs(x);
 		return (P * (y * fabs(y) - y) + y);
@@ -685,6 +889,8 @@ unsigned int antix::matrix_left_x_col;
 unsigned int antix::matrix_right_x_col;
 unsigned int antix::matrix_right_world_x_col;
 unsigned int antix::cmatrix_width;
+GridGeometry antix::vision_grid;
+GridGeometry antix::collision_grid;
 int antix::turn = 0;
 
 #endif
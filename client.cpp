@@ -1,32 +1,46 @@
 /*
-	Client connects to a node on its local machine & gets simulation parameters
-	Then it begins controlling robots
+	Client connects to one or more nodes on its local machine & gets simulation
+	parameters. Then it begins controlling its team's robots on those nodes
 */
 
 #define IS_CLIENT
 
 #include <map>
+#include <sstream>
 #include <dlfcn.h>
 #include "controller.cpp"
 
 using namespace std;
 
 Controller *ctlr;
+// AI library's batch entry point, or NULL if it only has the per robot one
+batch_controller_t batch_controller;
+// our robots laid out for the controller
+ControllerBatch batch;
+#if !CLIENT_MEMORY
+// robot memory copied out of the sense message, pointed to from batch
+vector<vector<int> > batch_ints;
+vector<vector<double> > batch_doubles;
+#endif
 
-string node_ipc_id;
+// we control our team's robots on each of these nodes (one per IPC id)
+vector<string> node_ipc_ids;
 
 int my_id;
 int sleep_time;
 int num_robots;
+// we are sensed & controlled every this many turns
+int control_period = 1;
 double home_radius;
 Home *my_home;
 
+// The following are per node, in the order of node_ipc_ids
 // local socket to control sock of node on our machine
-zmq::socket_t *node_req_sock;
+vector<zmq::socket_t *> node_req_socks;
 // socket to node's rep sync sock (also used for initialization)
-zmq::socket_t *node_sync_req_sock;
+vector<zmq::socket_t *> node_sync_req_socks;
 // socket to sync pub sock of node on our machine (also used for initialization)
-zmq::socket_t *node_sub_sock;
+vector<zmq::socket_t *> node_sub_socks;
 
 // construct some protobuf messages here so we don't call constructor needlessly
 antixtransfer::control_message sense_req_msg;
@@ -35,8 +49,65 @@ antixtransfer::sense_data sense_msg;
 // used for wait_for_next_turn()
 antixtransfer::done node_done_msg;
 
+#if CLIENT_MEMORY
+/*
+	A robot's memory when we keep it here rather than sending it to the node
+*/
+class RobotMemory {
+public:
+	double last_x,
+		last_y;
+	vector<int> ints;
+	vector<double> doubles;
+	// turn we last controlled the robot on, and whether we then handed it a
+	// motion primitive (it is not sensed until that is over)
+	int sensed_turn;
+	bool driven;
+
+	RobotMemory(double last_x, double last_y) : last_x(last_x), last_y(last_y), sensed_turn(0), driven(false) { }
+};
+
+// memory of robots we have controlled, by (team, id)
+map<pair<int, int>, RobotMemory> robot_memory;
+
+/*
+	Find the memory for the given robot, creating it if this is the first
+	time we have seen the robot
+*/
+RobotMemory *
+find_robot_memory(int team, int id) {
+	const pair<int, int> key(team, id);
+	map<pair<int, int>, RobotMemory>::iterator it = robot_memory.find(key);
+	if (it == robot_memory.end()) {
+		// A robot's first last_x/last_y is its home, as it is on the node
+		it = robot_memory.insert(
+			pair<pair<int, int>, RobotMemory>(key, RobotMemory(my_home->x, my_home->y))
+		).first;
+	}
+	return &it->second;
+}
+
+/*
+	Forget robots we did not control this turn: they have left our nodes.
+	Those we handed a motion primitive are kept until it must have ended
+	and the team been sensed again
+*/
+void
+erase_stale_memory() {
+	map<pair<int, int>, RobotMemory>::iterator it = robot_memory.begin();
+	while (it != robot_memory.end()) {
+		const RobotMemory *mem = &it->second;
+		if (mem->sensed_turn != antix::turn
+			&& !(mem->driven && antix::turn - mem->sensed_turn <= PRIMITIVE_MAX_TURNS + control_period))
+			robot_memory.erase(it++);
+		else
+			it++;
+	}
+}
+#endif
+
 void
-synchronize_sub_sock() {
+synchronize_sub_sock(zmq::socket_t *node_sub_sock, zmq::socket_t *node_sync_req_sock) {
 	antixtransfer::node_master_sync sync_msg;
 	sync_msg.set_my_id( my_id );
 
@@ -49,45 +120,198 @@ synchronize_sub_sock() {
 	antix::recv_blank(node_sync_req_sock);
 }
 
+#if SENSE_DELTA
 /*
-	Node has sent us the following sense data with at least one robot
-	Decide what to do and send a response
+	Our copy of a robot's state, built up from the changes the node sends
+*/
+class RobotMirror {
+public:
+	double x,
+		y,
+		a,
+		last_x,
+		last_y;
+	bool has_puck,
+		collided;
+	// (range, bearing) of seen robots
+	vector<pair<double, double> > seen_robots;
+	vector<CSeePuck> seen_pucks;
+	// mirror_mark when the robot was last in a sense message
+	unsigned int mark;
+
+	RobotMirror() : x(0), y(0), a(0), last_x(0), last_y(0), has_puck(false), collided(false), mark(0) { }
+};
+
+// per node, in the order of node_ipc_ids: our robots' state by robot id
+vector<map<int, RobotMirror> > robot_mirrors;
+// counts the sense messages mirrored
+unsigned int mirror_mark = 0;
 
-  Decision logic from rtv's Antix
+/*
+	Apply the fields given in robot_pb to our mirror of that robot
+	Returns the updated mirror entry
+*/
+RobotMirror *
+update_mirror(map<int, RobotMirror> *mirror, const antixtransfer::sense_data::Robot *robot_pb, const bool keyframe) {
+	RobotMirror *m = &(*mirror)[ robot_pb->id() ];
+	m->mark = mirror_mark;
+
+	if (robot_pb->has_x())
+		m->x = robot_pb->x();
+	if (robot_pb->has_y())
+		m->y = robot_pb->y();
+	if (robot_pb->has_a())
+		m->a = robot_pb->a();
+	if (robot_pb->has_has_puck())
+		m->has_puck = robot_pb->has_puck();
+	if (robot_pb->has_collided())
+		m->collided = robot_pb->collided();
+	if (robot_pb->has_last_x())
+		m->last_x = robot_pb->last_x();
+	if (robot_pb->has_last_y())
+		m->last_y = robot_pb->last_y();
+
+	// A keyframe always has full lists
+	assert( !keyframe || !robot_pb->has_seen_robot_count() );
+	assert( !keyframe || !robot_pb->has_seen_puck_count() );
+	if (robot_pb->has_seen_robot_count()) {
+		// only the entries that changed, at the given positions
+		m->seen_robots.resize( robot_pb->seen_robot_count() );
+		const int changed = robot_pb->seen_robot_size();
+		for (int j = 0; j < changed; j++) {
+			m->seen_robots[ robot_pb->seen_robot_index(j) ] =
+				pair<double, double>( robot_pb->seen_robot(j).range(), robot_pb->seen_robot(j).bearing() );
+		}
+	} else {
+		m->seen_robots.clear();
+		const int seen_robot_size = robot_pb->seen_robot_size();
+		for (int j = 0; j < seen_robot_size; j++) {
+			m->seen_robots.push_back(
+				pair<double, double>( robot_pb->seen_robot(j).range(), robot_pb->seen_robot(j).bearing() )
+			);
+		}
+	}
+	if (robot_pb->has_seen_puck_count()) {
+		m->seen_pucks.resize( robot_pb->seen_puck_count(), CSeePuck(false, 0, 0) );
+		const int changed = robot_pb->seen_puck_size();
+		for (int j = 0; j < changed; j++) {
+			m->seen_pucks[ robot_pb->seen_puck_index(j) ] =
+				CSeePuck(robot_pb->seen_puck(j).held(),
+					robot_pb->seen_puck(j).range(),
+					robot_pb->seen_puck(j).bearing());
+		}
+	} else {
+		m->seen_pucks.clear();
+		const int seen_puck_size = robot_pb->seen_puck_size();
+		for (int j = 0; j < seen_puck_size; j++) {
+			m->seen_pucks.push_back(
+				CSeePuck(robot_pb->seen_puck(j).held(),
+					robot_pb->seen_puck(j).range(),
+					robot_pb->seen_puck(j).bearing())
+			);
+		}
+	}
+	return m;
+}
+
+/*
+	Forget the robots that were not in the latest sense message from this
+	node: they have left it, or are driven by the node, and it sends them in
+	full when they are next ours to control there
 */
 void
-controller(zmq::socket_t *node, antixtransfer::sense_data *sense_msg) {
-	// Message that gets sent as a request containing multiple robots
-	control_msg.clear_robot();
+erase_stale_mirrors(map<int, RobotMirror> *mirror) {
+	map<int, RobotMirror>::iterator it = mirror->begin();
+	while (it != mirror->end()) {
+		if (it->second.mark != mirror_mark)
+			mirror->erase(it++);
+		else
+			it++;
+	}
+}
+#endif
+
+/*
+	Record a robot's puck action and any motion primitive in its response
+*/
+void
+set_control_action(antixtransfer::control_message::Robot *r, const int puck_action,
+	const int command, const double target_x, const double target_y, const double target_a) {
+	if (puck_action == PUCK_ACTION_PICKUP)
+		r->set_puck_action(antixtransfer::control_message::PICKUP);
+	else if (puck_action == PUCK_ACTION_DROP)
+		r->set_puck_action(antixtransfer::control_message::DROP);
+	else
+		r->set_puck_action(antixtransfer::control_message::NONE);
+
+	if (command != antixtransfer::control_message::SPEED) {
+		r->set_command( (antixtransfer::control_message::Command) command );
+		r->set_target_x( target_x );
+		r->set_target_y( target_y );
+		r->set_target_a( target_a );
+	}
+}
 
-	// For each robot in the sense data from this node, build a decision
+/*
+	Decide for each robot in turn with Controller::controller(), filling
+	ctlr straight from the sense message
+*/
+void
+controller_per_robot(const int node, antixtransfer::sense_data *sense_msg) {
 	int robot_size = sense_msg->robot_size();
 	for (int i = 0; i < robot_size; i++) {
-		// First we create a Controller with this robot's state
-
-		// XXX
-		// we copy seen_pucks to a vector to give a nicer interface
-		// this costs cpu... perhaps undesirable. but otherwise controller
-		// must look at protobuf...
+		const antixtransfer::sense_data::Robot *robot_pb = &sense_msg->robot(i);
+
+#if SENSE_DELTA
+		// Node only sent what changed: bring our mirror up to date and use it
+		RobotMirror *m = update_mirror(&robot_mirrors[node], robot_pb, sense_msg->keyframe());
+		ctlr->seen_pucks = m->seen_pucks;
+		ctlr->x = m->x;
+		ctlr->y = m->y;
+		ctlr->a = m->a;
+		ctlr->has_puck = m->has_puck;
+		ctlr->collided = m->collided;
+#else
 		ctlr->seen_pucks.clear();
-		int seen_puck_size = sense_msg->robot(i).seen_puck_size();
+		int seen_puck_size = robot_pb->seen_puck_size();
 		for (int j = 0; j < seen_puck_size; j++) {
 			ctlr->seen_pucks.push_back(
-				CSeePuck(sense_msg->robot(i).seen_puck(j).held(),
-					sense_msg->robot(i).seen_puck(j).range(),
-					sense_msg->robot(i).seen_puck(j).bearing())
+				CSeePuck(robot_pb->seen_puck(j).held(),
+					robot_pb->seen_puck(j).range(),
+					robot_pb->seen_puck(j).bearing())
 			);
 		}
-
-		ctlr->puck_action = PUCK_ACTION_NONE;
-		ctlr->x = sense_msg->robot(i).x();
-		ctlr->y = sense_msg->robot(i).y();
-		ctlr->a = sense_msg->robot(i).a();
-		ctlr->id = sense_msg->robot(i).id();
-		ctlr->last_x = sense_msg->robot(i).last_x();
-		ctlr->last_y = sense_msg->robot(i).last_y();
+		ctlr->x = robot_pb->x();
+		ctlr->y = robot_pb->y();
+		ctlr->a = robot_pb->a();
+		ctlr->has_puck = robot_pb->has_puck();
+		ctlr->collided = robot_pb->collided();
+#endif
+		ctlr->id = robot_pb->id();
 		ctlr->home = my_home;
-		ctlr->has_puck = sense_msg->robot(i).has_puck();
+		ctlr->puck_action = PUCK_ACTION_NONE;
+		ctlr->v = 0.0;
+		ctlr->w = 0.0;
+		ctlr->command = antixtransfer::control_message::SPEED;
+
+#if CLIENT_MEMORY
+		// memory is swapped in and back out rather than copied
+		RobotMemory *mem = find_robot_memory(my_id, robot_pb->id());
+		ctlr->last_x = mem->last_x;
+		ctlr->last_y = mem->last_y;
+		ctlr->ints.swap( mem->ints );
+		ctlr->doubles.swap( mem->doubles );
+#else
+#if SENSE_DELTA
+		ctlr->last_x = m->last_x;
+		ctlr->last_y = m->last_y;
+#else
+		ctlr->last_x = robot_pb->last_x();
+		ctlr->last_y = robot_pb->last_y();
+#endif
+		ctlr->ints.assign( robot_pb->ints().begin(), robot_pb->ints().end() );
+		ctlr->doubles.assign( robot_pb->doubles().begin(), robot_pb->doubles().end() );
+#endif
 
 #if DEBUG
 		cout << "Running controller for robot " << ctlr->id << " on turn " << antix::turn << endl;
@@ -95,47 +319,27 @@ controller(zmq::socket_t *node, antixtransfer::sense_data *sense_msg) {
 		cout << ctlr->last_x << ", " << ctlr->last_y << " as last_x/y" << endl;
 #endif
 
-		ctlr->v = 0.0;
-		ctlr->w = 0.0;
-
-		ctlr->doubles.clear();
-		ctlr->ints.clear();
-
-		ctlr->collided = sense_msg->robot(i).collided();
-
-		// Update this robot's memory
-		int doubles_size = sense_msg->robot(i).doubles_size();
-		for (int j = 0; j < doubles_size; j++) {
-			ctlr->doubles.push_back( sense_msg->robot(i).doubles(j) );
-		}
-		int ints_size = sense_msg->robot(i).ints_size();
-		for (int j = 0; j < ints_size; j++) {
-			ctlr->ints.push_back( sense_msg->robot(i).ints(j) );
-		}
-
-#if DEBUG
-		cout << "Got last x " << sense_msg->robot(i).last_x();
-		cout << " and last y " << sense_msg->robot(i).last_y();
-		cout << " on turn " << antix::turn << endl;
-#endif
-
-		// then run the controller
 		ctlr->controller();
 
 		// then add robot's new data to response protobuf
 		antixtransfer::control_message::Robot *r = control_msg.add_robot();
 		r->set_id( ctlr->id );
-		r->set_last_x( ctlr->last_x );
-		r->set_last_y( ctlr->last_y );
 		r->set_v( ctlr->v );
 		r->set_w( ctlr->w );
-
-		if (ctlr->puck_action == PUCK_ACTION_PICKUP)
-			r->set_puck_action(antixtransfer::control_message::PICKUP);
-		else if (ctlr->puck_action == PUCK_ACTION_DROP)
-			r->set_puck_action(antixtransfer::control_message::DROP);
-		else
-			r->set_puck_action(antixtransfer::control_message::NONE);
+		set_control_action(r, ctlr->puck_action, ctlr->command,
+			ctlr->target_x, ctlr->target_y, ctlr->target_a);
+
+#if CLIENT_MEMORY
+		// store memory for next turn
+		mem->last_x = ctlr->last_x;
+		mem->last_y = ctlr->last_y;
+		mem->sensed_turn = antix::turn;
+		mem->driven = ctlr->command != antixtransfer::control_message::SPEED;
+		ctlr->ints.swap( mem->ints );
+		ctlr->doubles.swap( mem->doubles );
+#else
+		r->set_last_x( ctlr->last_x );
+		r->set_last_y( ctlr->last_y );
 
 		vector<double>::const_iterator doubles_end = ctlr->doubles.end();
 		for (vector<double>::const_iterator it = ctlr->doubles.begin(); it != doubles_end; it++) {
@@ -145,110 +349,279 @@ controller(zmq::socket_t *node, antixtransfer::sense_data *sense_msg) {
 		for (vector<int>::const_iterator it = ctlr->ints.begin(); it != ints_end; it++) {
 			r->add_ints( *it );
 		}
+#endif
 	}
-
-	// send the decision for all of our robots to this node
-	antix::send_pb(node, &control_msg);
 }
 
 /*
-	Request from local node what our robots can see
-  Make a decision based on this & send it back
+	Lay every robot's state out in the batch, and decide for all of them in
+	one call to the AI library's batch_controller()
 */
 void
-sense_and_controller() {
-#if DEBUG_SYNC
-	cout << "Sync: Requesting sense data from node for my team: " << my_id << "..." << endl;
+controller_batch(const int node, antixtransfer::sense_data *sense_msg) {
+	batch.clear();
+	batch.home = my_home;
+
+	int robot_size = sense_msg->robot_size();
+#if !CLIENT_MEMORY
+	// memory comes from the message: copy it somewhere the batch can point to
+	if (batch_ints.size() < (size_t) robot_size) {
+		batch_ints.resize(robot_size);
+		batch_doubles.resize(robot_size);
+	}
+#endif
+	for (int i = 0; i < robot_size; i++) {
+		const antixtransfer::sense_data::Robot *robot_pb = &sense_msg->robot(i);
+
+#if CLIENT_MEMORY
+		RobotMemory *mem = find_robot_memory(my_id, robot_pb->id());
+		const double last_x = mem->last_x;
+		const double last_y = mem->last_y;
+		vector<int> *ints = &mem->ints;
+		vector<double> *doubles = &mem->doubles;
+#else
+		vector<int> *ints = &batch_ints[i];
+		vector<double> *doubles = &batch_doubles[i];
+		ints->assign( robot_pb->ints().begin(), robot_pb->ints().end() );
+		doubles->assign( robot_pb->doubles().begin(), robot_pb->doubles().end() );
 #endif
-	// Ask local node what the robots from our team sees
-	antix::send_pb(node_req_sock, &sense_req_msg);
 
-#if DEBUG_SYNC
-	cout << "Sync: Awaiting sense data response..." << endl;
+#if SENSE_DELTA
+		RobotMirror *m = update_mirror(&robot_mirrors[node], robot_pb, sense_msg->keyframe());
+#if !CLIENT_MEMORY
+		const double last_x = m->last_x;
+		const double last_y = m->last_y;
+#endif
+		batch.add_robot(robot_pb->id(), m->x, m->y, m->a, m->has_puck,
+			m->collided, last_x, last_y, ints, doubles);
+
+		vector<CSeePuck>::const_iterator seen_pucks_end = m->seen_pucks.end();
+		for (vector<CSeePuck>::const_iterator it = m->seen_pucks.begin(); it != seen_pucks_end; it++)
+			batch.add_seen_puck(it->held, it->range, it->bearing);
+#else
+#if !CLIENT_MEMORY
+		const double last_x = robot_pb->last_x();
+		const double last_y = robot_pb->last_y();
 #endif
-	// Get the sense data back from the node
-	int rc = antix::recv_pb(node_req_sock, &sense_msg, 0);
-	assert(rc == 1);
+		batch.add_robot(robot_pb->id(), robot_pb->x(), robot_pb->y(), robot_pb->a(),
+			robot_pb->has_puck(), robot_pb->collided(), last_x, last_y, ints, doubles);
 
-#if DEBUG_SYNC
-	cout << "Sync: Got sense data with " << sense_msg.robot_size() << " robots." << endl;
+		int seen_puck_size = robot_pb->seen_puck_size();
+		for (int j = 0; j < seen_puck_size; j++) {
+			batch.add_seen_puck(robot_pb->seen_puck(j).held(),
+				robot_pb->seen_puck(j).range(),
+				robot_pb->seen_puck(j).bearing());
+		}
 #endif
+	}
 
-	// if there's at least one robot in the response, we will be sending a command
-	if (sense_msg.robot_size() > 0) {
-		controller(node_req_sock, &sense_msg);
+	batch_controller(ctlr, &batch);
 
-#if DEBUG_SYNC
-		cout << "Sync: Awaiting responses from node we sent commands to..." << endl;
+	// then add robots' new data to response protobuf
+	for (int i = 0; i < batch.size; i++) {
+		antixtransfer::control_message::Robot *r = control_msg.add_robot();
+		r->set_id( batch.id[i] );
+		r->set_v( batch.v[i] );
+		r->set_w( batch.w[i] );
+		set_control_action(r, batch.puck_action[i], batch.command[i],
+			batch.target_x[i], batch.target_y[i], batch.target_a[i]);
+
+#if CLIENT_MEMORY
+		// store memory for next turn. ints/doubles were written in place
+		RobotMemory *mem = find_robot_memory(my_id, batch.id[i]);
+		mem->last_x = batch.last_x[i];
+		mem->last_y = batch.last_y[i];
+		mem->sensed_turn = antix::turn;
+		mem->driven = batch.command[i] != antixtransfer::control_message::SPEED;
+#else
+		r->set_last_x( batch.last_x[i] );
+		r->set_last_y( batch.last_y[i] );
+
+		vector<double>::const_iterator doubles_end = batch.doubles[i]->end();
+		for (vector<double>::const_iterator it = batch.doubles[i]->begin(); it != doubles_end; it++) {
+			r->add_doubles( *it );
+		}
+		vector<int>::const_iterator ints_end = batch.ints[i]->end();
+		for (vector<int>::const_iterator it = batch.ints[i]->begin(); it != ints_end; it++) {
+			r->add_ints( *it );
+		}
 #endif
-		// get response back since REQ sock
-		antix::recv_blank(node_req_sock);
 	}
-#if DEBUG_SYNC
-	cout << "Sync: Sensing & controlling done." << endl;
+}
+
+/*
+	Node (index into node_ipc_ids) has sent us the following sense data with
+	at least one robot. Decide what to do and send a response
+
+  Decision logic from rtv's Antix
+*/
+void
+controller(const int node, antixtransfer::sense_data *sense_msg) {
+	// Message that gets sent as a request containing multiple robots
+	control_msg.clear_robot();
+#if SENSE_DELTA
+	mirror_mark++;
 #endif
+
+	if (batch_controller != NULL)
+		controller_batch(node, sense_msg);
+	else
+		controller_per_robot(node, sense_msg);
+
+#if SENSE_DELTA
+	erase_stale_mirrors(&robot_mirrors[node]);
+#endif
+
+	// send the decision for all of our robots to this node
+	antix::send_pb(node_req_socks[node], &control_msg);
 }
 
 /*
-  Look through the list of homes from init response & find our own
+	Request from each of our nodes what our robots can see
+  Make a decision based on this & send it back
+
+	Requests go to all nodes at once, and each node's robots are decided for
+	as soon as its reply arrives
 */
-Home *
-find_our_home(antixtransfer::connect_init_response *init_response) {
-	for (int i = 0; i < init_response->home_size(); i++) {
-		if (init_response->home(i).team() == my_id)
-			return new Home( init_response->home(i).x(), init_response->home(i).y(), home_radius, init_response->home(i).team() );
+void
+sense_and_controller() {
+	const int num_nodes = node_req_socks.size();
+#if DEBUG_SYNC
+	cout << "Sync: Requesting sense data from " << num_nodes << " nodes for my team: " << my_id << "..." << endl;
+#endif
+	// Ask each node what the robots from our team sees
+	for (int i = 0; i < num_nodes; i++)
+		antix::send_pb(node_req_socks[i], &sense_req_msg);
+
+	// per node: true while we wait for the reply to our command message
+	vector<bool> awaiting_command_reply(num_nodes, false);
+	vector<zmq::pollitem_t> items(num_nodes);
+	for (int i = 0; i < num_nodes; i++) {
+		items[i].socket = *node_req_socks[i];
+		items[i].fd = 0;
+		items[i].events = ZMQ_POLLIN;
+		items[i].revents = 0;
 	}
-	return NULL;
-}
 
-int
-main(int argc, char **argv) {
-	GOOGLE_PROTOBUF_VERIFY_VERSION;
-	zmq::context_t context(1);
-	srand( time(NULL) );
-	srand48( time(NULL) );
+	int outstanding = num_nodes;
+	while (outstanding > 0) {
+		zmq::poll(&items[0], num_nodes, -1);
+		for (int i = 0; i < num_nodes; i++) {
+			if (!(items[i].revents & ZMQ_POLLIN))
+				continue;
+
+			if (awaiting_command_reply[i]) {
+				// get response back since REQ sock
+				antix::recv_blank(node_req_socks[i]);
+				awaiting_command_reply[i] = false;
+				items[i].events = 0;
+				outstanding--;
+				continue;
+			}
+
+			// Get the sense data back from the node
+			int rc = antix::recv_pb(node_req_socks[i], &sense_msg, 0);
+			assert(rc == 1);
+#if DEBUG_SYNC
+			cout << "Sync: Got sense data with " << sense_msg.robot_size() << " robots from node " << node_ipc_ids[i] << endl;
+#endif
 
-	if (argc != 5) {
-		cerr << "Usage: " << argv[0] << " <# of robots> <client id> <node IPC id> <AI library.so>" << endl;
-		return -1;
+			// if there's at least one robot in the response, we will be sending a command
+			if (sense_msg.robot_size() > 0) {
+				controller(i, &sense_msg);
+				awaiting_command_reply[i] = true;
+			} else {
+				items[i].events = 0;
+				outstanding--;
+			}
+		}
 	}
-	assert(atoi(argv[1]) > 0);
-	num_robots = atoi(argv[1]);
-	my_id = atoi(argv[2]);
-	node_ipc_id = string(argv[3]);
-	string ai_library = string(argv[4]);
+#if CLIENT_MEMORY
+	erase_stale_memory();
+#endif
+#if DEBUG_SYNC
+	cout << "Sync: Sensing & controlling done." << endl;
+#endif
+}
 
-	// If non absolute path, assume cwd for AI.so path
-	if (ai_library[0] != '/')
-		ai_library = "./" + ai_library;
+/*
+	Tell each of our nodes we are done this turn, then wait for all of them
+	to begin the next one
 
-	// Load AI dynamically
-	// From http://stackoverflow.com/questions/496664/c-dynamic-shared-library-on-linux
-	void* handle = dlopen(ai_library.c_str(), RTLD_NOW | RTLD_GLOBAL);
-	if (handle == NULL) {
-		cerr << "Error: could not load AI library: " << dlerror() << endl;
-		exit(-1);
+	Unlike antix::wait_for_next_turn(), which waits for begin from the node
+	before returning, all done messages must be sent before waiting on any
+	begin: no node begins until every node has finished
+*/
+string
+wait_for_next_turn_all() {
+	const int num_nodes = node_sync_req_socks.size();
+	for (int i = 0; i < num_nodes; i++) {
+		int ret = antix::send_pb_envelope(node_sync_req_socks[i], &node_done_msg, "done");
+		assert(ret == 1);
 	}
-	Controller* (*create)();
-	void (*destroy)(Controller*);
-	create = (Controller* (*)())dlsym(handle, "create_object");
-	destroy = (void (*)(Controller*))dlsym(handle, "destroy_object");
-	ctlr = (Controller*) create();
+	for (int i = 0; i < num_nodes; i++)
+		antix::recv_blank(node_sync_req_socks[i]);
 
-	// initialize some protobufs that do not change
-	sense_req_msg.set_team(my_id);
-	control_msg.set_team(my_id);
-	node_done_msg.set_my_id(my_id);
-	node_done_msg.set_type( antixtransfer::done::CLIENT );
+	// all nodes are in the same turn, so all send the same signal
+	string response;
+	for (int i = 0; i < num_nodes; i++)
+		response = antix::recv_str(node_sub_socks[i]);
+	return response;
+}
 
-	cout << "Connecting to local node..." << endl;
+#if CLIENT_DEADLINE_MS
+/*
+	If we were late, nodes have begun turns without us and their begin
+	signals are queued. Take them all so our next sense request is for the
+	nodes' current turn
+*/
+string
+catch_up_turns(string response) {
+	const int num_nodes = node_sub_socks.size();
+	string s;
+	// begins taken from each node
+	vector<int> begun(num_nodes, 0);
+	int turns = 0;
+	for (int i = 0; i < num_nodes; i++) {
+		while (antix::recv_str(node_sub_socks[i], &s, ZMQ_NOBLOCK) == 1) {
+			if (s == "s")
+				response = s;
+			else
+				begun[i]++;
+		}
+		turns = max(turns, begun[i]);
+	}
+	if (response == "s")
+		return response;
+
+	// nodes begin turns together, but their signals may not all be here yet:
+	// wait for the rest so every node's next begin is for the same turn
+	for (int i = 0; i < num_nodes; i++) {
+		while (begun[i] < turns) {
+			if (antix::recv_str(node_sub_socks[i]) == "s")
+				return "s";
+			begun[i]++;
+		}
+	}
+	antix::turn += turns;
+	return response;
+}
+#endif
 
+/*
+	Connect to the node with the given IPC id, adding its sockets to ours
+*/
+void
+connect_to_node(zmq::context_t *context, const string &node_ipc_id) {
 	string node_ipc_prefix = IPC_PREFIX;
+	zmq::socket_t *node_sync_req_sock;
+	zmq::socket_t *node_sub_sock;
+	zmq::socket_t *node_req_sock;
 
 	// node sync req sock
 	while (1) {
 		try {
-			node_sync_req_sock = new zmq::socket_t(context, ZMQ_REQ);
+			node_sync_req_sock = new zmq::socket_t(*context, ZMQ_REQ);
 		} catch (zmq::error_t e) {
 			cout << "Error: Node sync req new: " << e.what() << endl;
 			delete node_sync_req_sock;
@@ -272,7 +645,7 @@ main(int argc, char **argv) {
 	// node sync sub sock
 	while (1) {
 		try {
-			node_sub_sock = new zmq::socket_t(context, ZMQ_SUB);
+			node_sub_sock = new zmq::socket_t(*context, ZMQ_SUB);
 		} catch (zmq::error_t e) {
 			cout << "Error: Node sync sub new: " << e.what() << endl;
 			delete node_sub_sock;
@@ -297,7 +670,7 @@ main(int argc, char **argv) {
 	// node control
 	while (1) {
 		try {
-			node_req_sock = new zmq::socket_t(context, ZMQ_REQ);
+			node_req_sock = new zmq::socket_t(*context, ZMQ_REQ);
 		} catch (zmq::error_t e) {
 			cout << "Error: Node req new: " << e.what() << endl;
 			delete node_req_sock;
@@ -318,32 +691,133 @@ main(int argc, char **argv) {
 		break;
 	}
 
-	cout << "Connected to local node. Telling it of our existence..." << endl;
+	node_sync_req_socks.push_back(node_sync_req_sock);
+	node_sub_socks.push_back(node_sub_sock);
+	node_req_socks.push_back(node_req_sock);
+}
+
+/*
+  Look through the list of homes from init response & find our own
+*/
+Home *
+find_our_home(antixtransfer::connect_init_response *init_response) {
+	for (int i = 0; i < init_response->home_size(); i++) {
+		if (init_response->home(i).team() == my_id)
+			return new Home( init_response->home(i).x(), init_response->home(i).y(), home_radius, init_response->home(i).team() );
+	}
+	return NULL;
+}
+
+int
+main(int argc, char **argv) {
+	GOOGLE_PROTOBUF_VERIFY_VERSION;
+	zmq::context_t context(1);
+	srand( time(NULL) );
+	srand48( time(NULL) );
+
+	if (argc != 5 && argc != 6) {
+		cerr << "Usage: " << argv[0] << " <# of robots> <client id> <node IPC id[,node IPC id...]> <AI library.so> [control period]" << endl;
+		cerr << "Given several local IPC nodes (on this machine), this one client controls our team's robots on all of them." << endl;
+		cerr << "Each of them answers every turn, with no robots if it holds none of ours." << endl;
+		cerr << "Given a control period K, our robots are sensed & controlled every K turns." << endl;
+		return -1;
+	}
+	if (argc == 6) {
+		control_period = atoi(argv[5]);
+		if (control_period <= 0) {
+			cerr << "Error: control period must be at least 1" << endl;
+			return -1;
+		}
+	}
+	assert(atoi(argv[1]) > 0);
+	num_robots = atoi(argv[1]);
+	my_id = atoi(argv[2]);
+	stringstream node_ipc_list( (string(argv[3])) );
+	string node_ipc_id;
+	while (getline(node_ipc_list, node_ipc_id, ','))
+		node_ipc_ids.push_back(node_ipc_id);
+	assert(node_ipc_ids.size() > 0);
+#if NEIGHBOUR_SYNC
+	// nodes are not in step with each other, and we wait on all of them
+	if (node_ipc_ids.size() > 1) {
+		cerr << "Error: a client controls robots on one node only with NEIGHBOUR_SYNC" << endl;
+		return -1;
+	}
+#endif
+	string ai_library = string(argv[4]);
+
+	// If non absolute path, assume cwd for AI.so path
+	if (ai_library[0] != '/')
+		ai_library = "./" + ai_library;
+
+	// Load AI dynamically
+	// From http://stackoverflow.com/questions/496664/c-dynamic-shared-library-on-linux
+	void* handle = dlopen(ai_library.c_str(), RTLD_NOW | RTLD_GLOBAL);
+	if (handle == NULL) {
+		cerr << "Error: could not load AI library: " << dlerror() << endl;
+		exit(-1);
+	}
+	Controller* (*create)();
+	void (*destroy)(Controller*);
+	create = (Controller* (*)())dlsym(handle, "create_object");
+	destroy = (void (*)(Controller*))dlsym(handle, "destroy_object");
+	ctlr = (Controller*) create();
+	// optional: libraries may decide for all robots in one call
+	batch_controller = (batch_controller_t) dlsym(handle, "batch_controller");
+	if (batch_controller != NULL)
+		cout << "AI library has a batch controller." << endl;
+
+	// initialize some protobufs that do not change
+	sense_req_msg.set_team(my_id);
+	control_msg.set_team(my_id);
+	node_done_msg.set_my_id(my_id);
+	node_done_msg.set_type( antixtransfer::done::CLIENT );
+
+	cout << "Connecting to local nodes..." << endl;
+
+	for (vector<string>::const_iterator it = node_ipc_ids.begin(); it != node_ipc_ids.end(); it++)
+		connect_to_node(&context, *it);
+	const int num_nodes = node_ipc_ids.size();
+#if SENSE_DELTA
+	robot_mirrors.resize(num_nodes);
+#endif
+
+	cout << "Connected to " << num_nodes << " local node(s). Telling them of our existence..." << endl;
 
 	// Identify ourself & specify num robots we want
 	antixtransfer::connect_init_client init_req;
 	init_req.set_num_robots( num_robots );
 	init_req.set_id( my_id );
-	antix::send_pb(node_sync_req_sock, &init_req);
+	init_req.set_control_period( control_period );
+	for (int i = 0; i < num_nodes; i++) {
+		antix::send_pb(node_sync_req_socks[i], &init_req);
 
-	// Get back blank in response since REQ sock
-	antix::recv_blank(node_sync_req_sock);
+		// Get back blank in response since REQ sock
+		antix::recv_blank(node_sync_req_socks[i]);
+	}
 
-	// Make sure we are synchronized with node's pub sock
-	synchronize_sub_sock();
+	// Make sure we are synchronized with each node's pub sock
+	for (int i = 0; i < num_nodes; i++)
+		synchronize_sub_sock(node_sub_socks[i], node_sync_req_socks[i]);
 	
 	cout << "Waiting for signal for simulation begin..." << endl;
 
 	// Wait for response containing simulation params / home location
 	// This also indicates simulation begin
+	// Every node sends the same parameters: keep the first
 	antixtransfer::connect_init_response init_response;
-	// we may get messages on sub sock from node syncing other clients. ignore
-	string s;
-	while (s != "cli_begin")
-		s = antix::recv_str(node_sub_sock);
-
-	int rc = antix::recv_pb(node_sub_sock, &init_response, 0);
-	assert(rc == 1);
+	for (int i = 0; i < num_nodes; i++) {
+		// we may get messages on sub sock from node syncing other clients. ignore
+		string s;
+		while (s != "cli_begin")
+			s = antix::recv_str(node_sub_socks[i]);
+
+		antixtransfer::connect_init_response node_init_response;
+		int rc = antix::recv_pb(node_sub_socks[i], &node_init_response, 0);
+		assert(rc == 1);
+		if (i == 0)
+			init_response.CopyFrom(node_init_response);
+	}
 	home_radius = init_response.home_radius();
 	sleep_time = init_response.sleep_time();
 	Robot::pickup_range = init_response.pickup_range();
@@ -362,19 +836,24 @@ main(int argc, char **argv) {
 	// enter main loop
 	while (1) {
 		// sense, then decide & send what commands for each robot
-		sense_and_controller();
+		// (on our turns only: nodes expect nothing from us otherwise)
+		if ( (antix::turn + my_id) % control_period == 0 )
+			sense_and_controller();
 
 		// XXX it's possible we should use a different function than this
 		// as this includes score data definition (done msg) for node which
 		// may waste cpu depending on protobuf impl.
-		response = antix::wait_for_next_turn(node_sync_req_sock, node_sub_sock, &node_done_msg);
+		response = wait_for_next_turn_all();
+#if CLIENT_DEADLINE_MS
+		if (response == "b")
+			response = catch_up_turns(response);
+#endif
 		if (response == "s")
 			// leave loop
 			break;
 
-#if DEBUG
+		// kept in step with the nodes' turn, to know when we are controlled
 		antix::turn++;
-#endif
 
 #if SLEEP
 		antix::sleep(sleep_time);
@@ -384,9 +863,11 @@ main(int argc, char **argv) {
 	cout << "Received shutdown message from node. Shutting down..." << endl;
 
 	delete my_home;
-	delete node_sync_req_sock;
-	delete node_sub_sock;
-	delete node_req_sock;
+	for (int i = 0; i < num_nodes; i++) {
+		delete node_sync_req_socks[i];
+		delete node_sub_socks[i];
+		delete node_req_socks[i];
+	}
 
 	destroy(ctlr);
 	dlclose(handle);
@@ -29,6 +29,12 @@ public:
 	int puck_action;
 	double v,
 		w;
+	// SPEED to set v/w, or a motion primitive the node carries out at
+	// speed v. See control_message in antix.proto
+	int command;
+	double target_x,
+		target_y,
+		target_a;
 
 	bool collided;
 
@@ -42,7 +48,176 @@ public:
 	virtual void controller();
 };
 
-#ifndef IS_CLIENT
+/*
+	A whole team's robots (on one node) laid out as arrays, so that a
+	controller can decide for all of them in one call
+
+	Robot i's seen pucks are entries puck_start[i] to puck_start[i + 1] - 1
+	of the puck_ arrays
+*/
+class ControllerBatch {
+public:
+	int size;
+	Home *home;
+
+	// inputs
+	vector<int> id;
+	vector<double> x,
+		y,
+		a;
+	vector<char> has_puck,
+		collided;
+	vector<int> puck_start;
+	vector<double> puck_range,
+		puck_bearing;
+	vector<char> puck_held;
+
+	// read and written: robot memory
+	vector<double> last_x,
+		last_y;
+	vector<vector<int> *> ints;
+	vector<vector<double> *> doubles;
+
+	// outputs
+	vector<double> v,
+		w;
+	vector<int> puck_action;
+	vector<int> command;
+	vector<double> target_x,
+		target_y,
+		target_a;
+
+	ControllerBatch() {
+		clear();
+	}
+
+	void
+	clear() {
+		size = 0;
+		id.clear();
+		x.clear();
+		y.clear();
+		a.clear();
+		has_puck.clear();
+		collided.clear();
+		puck_start.assign(1, 0);
+		puck_range.clear();
+		puck_bearing.clear();
+		puck_held.clear();
+		last_x.clear();
+		last_y.clear();
+		ints.clear();
+		doubles.clear();
+		v.clear();
+		w.clear();
+		puck_action.clear();
+		command.clear();
+		target_x.clear();
+		target_y.clear();
+		target_a.clear();
+	}
+
+	/*
+		Append a robot. Its seen pucks are then given with add_seen_puck()
+		Returns the robot's index in the batch
+	*/
+	int
+	add_robot(int robot_id, double robot_x, double robot_y, double robot_a,
+		bool robot_has_puck, bool robot_collided, double robot_last_x,
+		double robot_last_y, vector<int> *robot_ints, vector<double> *robot_doubles) {
+
+		id.push_back(robot_id);
+		x.push_back(robot_x);
+		y.push_back(robot_y);
+		a.push_back(robot_a);
+		has_puck.push_back(robot_has_puck);
+		collided.push_back(robot_collided);
+		puck_start.push_back( puck_start.back() );
+		last_x.push_back(robot_last_x);
+		last_y.push_back(robot_last_y);
+		ints.push_back(robot_ints);
+		doubles.push_back(robot_doubles);
+		v.push_back(0.0);
+		w.push_back(0.0);
+		puck_action.push_back(PUCK_ACTION_NONE);
+		command.push_back(antixtransfer::control_message::SPEED);
+		target_x.push_back(0.0);
+		target_y.push_back(0.0);
+		target_a.push_back(0.0);
+		return size++;
+	}
+
+	/*
+		Add a puck seen by the most recently added robot
+	*/
+	void
+	add_seen_puck(bool held, double range, double bearing) {
+		puck_held.push_back(held);
+		puck_range.push_back(range);
+		puck_bearing.push_back(bearing);
+		puck_start.back()++;
+	}
+};
+
+/*
+	Optional AI library entry point deciding for a whole batch at once:
+	extern "C" void batch_controller(Controller *, ControllerBatch *)
+	Libraries without it are run one robot at a time through
+	Controller::controller(). The client fills the Controller straight from
+	the sense message; the node goes through run_controller_per_robot()
+
+	Robot memory (ints/doubles) is not laid out as arrays: each robot's
+	vectors are pointed to, as they are of any length
+*/
+typedef void (*batch_controller_t)(Controller *, ControllerBatch *);
+
+/*
+	Run the per robot Controller::controller() over every robot in the batch
+*/
+static inline void
+run_controller_per_robot(Controller *ctlr, ControllerBatch *batch) {
+	for (int i = 0; i < batch->size; i++) {
+		ctlr->seen_pucks.clear();
+		const int pucks_end = batch->puck_start[i + 1];
+		for (int j = batch->puck_start[i]; j < pucks_end; j++)
+			ctlr->seen_pucks.push_back( CSeePuck(batch->puck_held[j], batch->puck_range[j], batch->puck_bearing[j]) );
+
+		ctlr->id = batch->id[i];
+		ctlr->x = batch->x[i];
+		ctlr->y = batch->y[i];
+		ctlr->a = batch->a[i];
+		ctlr->has_puck = batch->has_puck[i];
+		ctlr->collided = batch->collided[i];
+		ctlr->last_x = batch->last_x[i];
+		ctlr->last_y = batch->last_y[i];
+		ctlr->home = batch->home;
+		ctlr->puck_action = PUCK_ACTION_NONE;
+		ctlr->v = 0.0;
+		ctlr->w = 0.0;
+		ctlr->command = antixtransfer::control_message::SPEED;
+
+		// memory is swapped in and back out rather than copied
+		ctlr->ints.swap( *batch->ints[i] );
+		ctlr->doubles.swap( *batch->doubles[i] );
+
+		ctlr->controller();
+
+		ctlr->ints.swap( *batch->ints[i] );
+		ctlr->doubles.swap( *batch->doubles[i] );
+
+		batch->last_x[i] = ctlr->last_x;
+		batch->last_y[i] = ctlr->last_y;
+		batch->v[i] = ctlr->v;
+		batch->w[i] = ctlr->w;
+		batch->puck_action[i] = ctlr->puck_action;
+		batch->command[i] = ctlr->command;
+		batch->target_x[i] = ctlr->target_x;
+		batch->target_y[i] = ctlr->target_y;
+		batch->target_a[i] = ctlr->target_a;
+	}
+}
+
+#if !defined(IS_CLIENT) && !defined(IS_NODE)
 /*
 	The following 2 functions are used for dynamic class loading
 */
@@ -54,15 +54,24 @@ public:
 
 class Robot;
 
+
 class Puck {
 public:
-	double x,
+	// while held, x, y & index are not kept up to date: the puck is where
+	// robot is, and is not in the sense matrix
+	coord_t x,
 		y;
 	unsigned int index;
 	bool held;
 	Robot *robot;
 	Home *home;
 	int lifetime;
+#if SENSE_NEIGHBOUR_LISTS
+	// where we were when neighbour lists were built, and if we were held
+	double listed_x,
+		listed_y;
+	bool listed_held;
+#endif
 
 	// random pose stuff is from rtv's Antix
 	Puck(double min_x, double max_x) {
@@ -84,10 +93,11 @@ public:
 
 class SeePuck {
 public:
-	double range;
+	double range,
+		bearing;
 	Puck *puck;
 
-	SeePuck(Puck *puck, double range) : puck(puck), range(range) {}
+	SeePuck(Puck *puck, double range, double bearing) : puck(puck), range(range), bearing(bearing) {}
 };
 
 /*
@@ -103,15 +113,141 @@ public:
 		: held(held), range(range), bearing(bearing) { }
 };
 
+/*
+	What we last sent a robot's client about the robot. Used to send only
+	what has changed (SENSE_DELTA)
+*/
+class SenseSent {
+public:
+	// false if we have not yet sent anything about this robot from this node
+	bool valid;
+	double x,
+		y,
+		a,
+		last_x,
+		last_y;
+	bool has_puck,
+		collided;
+	// (range, bearing) of seen robots
+	vector<pair<double, double> > seen_robots;
+	vector<CSeePuck> seen_pucks;
+
+	SenseSent() : valid(false) { }
+};
+
 /*
 	from rtv's Antix
 */
+/*
+	One bit per sense matrix cell, set while the cell holds something, and
+	one bit per 64 cells set while any of them does. Scans find the non-empty
+	cells in a range of indices a word at a time
+*/
+class Occupancy {
+public:
+	vector<uint64_t> cells;
+	vector<uint64_t> blocks;
+
+	void
+	resize(size_t size) {
+		cells.assign( (size + 63) / 64, 0 );
+		blocks.assign( (cells.size() + 63) / 64, 0 );
+	}
+
+	void
+	set(unsigned int index) {
+		const unsigned int word = index >> 6;
+		cells[word] |= (uint64_t) 1 << (index & 63);
+		blocks[word >> 6] |= (uint64_t) 1 << (word & 63);
+	}
+
+	void
+	clear(unsigned int index) {
+		const unsigned int word = index >> 6;
+		cells[word] &= ~( (uint64_t) 1 << (index & 63) );
+		if (cells[word] == 0)
+			blocks[word >> 6] &= ~( (uint64_t) 1 << (word & 63) );
+	}
+
+	/*
+		First set index from from to last, or last + 1 if none
+	*/
+	unsigned int
+	next(unsigned int from, const unsigned int last) const {
+		while (from <= last) {
+			const unsigned int word = from >> 6;
+			// whole block of 64 words empty: skip to the next
+			if ( (blocks[word >> 6] >> (word & 63)) == 0 ) {
+				from = ((word >> 6) + 1) << 12;
+				continue;
+			}
+			const uint64_t bits = cells[word] >> (from & 63);
+			if (bits != 0) {
+				from += __builtin_ctzll( bits );
+				break;
+			}
+			from = (word + 1) << 6;
+		}
+		return from <= last ? from : last + 1;
+	}
+};
+
 class MatrixCell {
 public:
 	vector<Robot *> robots;
 	vector<Puck *> pucks;
+	// how many of robots carry a puck. Held pucks are not in pucks
+	unsigned int held_pucks;
+	// Robot::sense_epoch when a robot / puck last entered, left or moved in
+	// the cell. Changes go through the Robot::cell_ functions
+	unsigned int robots_stamp,
+		pucks_stamp;
+
+	MatrixCell() : held_pucks(0), robots_stamp(0), pucks_stamp(0) { }
 };
 
+#if ROBOT_POOL
+/*
+	Memory for Robots, handed out from large blocks with each Robot starting
+	on a cache line. Robots made together sit together, and the fields used
+	each turn (first in Robot) share one line
+*/
+class RobotPool {
+public:
+	static void *
+	allocate(size_t size) {
+		assert(size == object_size || object_size == 0);
+		if (free_slots.empty())
+			grow(size);
+		void *p = free_slots.back();
+		free_slots.pop_back();
+		return p;
+	}
+
+	static void
+	release(void *p) {
+		if (p != NULL)
+			free_slots.push_back(p);
+	}
+
+private:
+	static vector<void *> free_slots;
+	static size_t object_size;
+
+	static void
+	grow(size_t size) {
+		object_size = size;
+		const size_t stride = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+		void *block;
+		if (posix_memalign(&block, CACHE_LINE, stride * ROBOT_POOL_BLOCK) != 0)
+			throw std::bad_alloc();
+		// so slots are handed out in address order
+		for (int i = ROBOT_POOL_BLOCK - 1; i >= 0; i--)
+			free_slots.push_back( (char *) block + i * stride );
+	}
+};
+#endif
+
 class Robot {
 public:
 	static double pickup_range;
@@ -120,26 +256,54 @@ public:
 	static double vision_range_squared;
 	static double robot_radius;
 	static vector<MatrixCell> matrix;
-	static vector<Robot *> cmatrix;
+	// collision matrix: first robot in each bucket of
+	// COLLISION_BUCKET_CELLS x COLLISION_BUCKET_CELLS collision cells
+	static vector<Robot *> cbuckets;
+	static unsigned int cbucket_width;
+#if SENSE_OCCUPANCY
+	// which cells of matrix hold robots / pucks
+	static Occupancy robots_occupied;
+	static Occupancy pucks_occupied;
+#endif
+	// incremented each time sense data is built
+	static unsigned int sense_epoch;
+
+	/*
+		Used every turn when moving & colliding: kept together at the start.
+		What other robots' collision checks read is in the first cache line
+	*/
+	coord_t x, y;
+	// orientation
+	coord_t a;
+	// forward speed
+	double v;
+	// turn speed
+	double w;
 
 	// index into sensor matrix
 	unsigned int index;
 	// index into collision matrix
 	unsigned int cindex;
-
-	bool collided;
+	// next robot in our collision bucket
+	Robot *cnext;
 
 	// Critical section vector we're in, or NULL
 	vector<Robot *> *critical_section;
-	bool in_critical;
 
-	double x, y;
-	// orientation
-	double a;
-	// forward speed
-	double v;
-	// turn speed
-	double w;
+	// motion primitive we are carrying out, or SPEED if the client
+	// sets v/w itself
+	int command;
+
+	// we collided since our controller last sensed us (or since our motion
+	// primitive began). Cleared once sensed, so it is not missed on the
+	// turns a team is not sensed
+	bool collided;
+	bool has_puck;
+
+	/*
+		The rest are used when sensing, migrating, or by controllers
+	*/
+	Puck *puck;
 
 	// last point we were heading to. see .proto for why
 	double last_x;
@@ -150,8 +314,6 @@ public:
 	int team;
 	int id;
 
-	bool has_puck;
-	Puck *puck;
 	Home *home;
 
 	// store what pucks we can see
@@ -163,8 +325,48 @@ public:
 
 	bbox_t sensor_bbox;
 
+	// what our client was last told
+	SenseSent sent;
+
+	// (range, bearing) of the robots we could see when last sensed
+	vector<pair<double, double> > see_robots;
+	// sense_epoch and our pose when see_robots / see_pucks were found.
+	// sensed_epoch is 0 if they are not to be reused
+	unsigned int sensed_epoch;
+	double sensed_x,
+		sensed_y,
+		sensed_a;
+
+#if SENSE_NEIGHBOUR_LISTS
+	// robots & pucks within vision_range + skin when lists were built, and
+	// where we were then
+	vector<Robot *> near_robots;
+	vector<Puck *> near_pucks;
+	double listed_x,
+		listed_y;
+#endif
+
+	// motion primitive targets, and turns it may still run
+	double target_x,
+		target_y,
+		target_a,
+		cruise_v;
+	int command_turns;
+
+#if ROBOT_POOL
+	static void *
+	operator new(size_t size) {
+		return RobotPool::allocate(size);
+	}
+
+	static void
+	operator delete(void *p) {
+		RobotPool::release(p);
+	}
+#endif
+
 	// Used in Map
-	Robot(double x, double y, int id, int team, double last_x, double last_y) : x(x), y(y), id(id), team(team), last_x(last_x), last_y(last_y) {
+	Robot(double x, double y, int id, int team, double last_x, double last_y) : x(x), y(y), last_x(last_x), last_y(last_y), team(team), id(id) {
 		a = 0;
 		v = 0;
 		w = 0;
@@ -172,13 +374,19 @@ public:
 		has_puck = false;
 		index = 0;
 		cindex = 0;
+		cnext = NULL;
 		home = NULL;
 		collided = false;
 		critical_section = NULL;
+		command = antixtransfer::control_message::SPEED;
+		command_turns = 0;
+		sensed_epoch = 0;
+		// robots at rest are not moved, so may be sensed before any update
+		FovBBox( sensor_bbox );
 	}
 
 	// Used in GUI & foreign robots
-	Robot(double x, double y, int team, double a) : x(x), y(y), team(team), a(a) {
+	Robot(double x, double y, int team, double a) : x(x), y(y), a(a), team(team) {
 		id = -1;
 		v = 0;
 		w = 0;
@@ -186,9 +394,93 @@ public:
 		has_puck = false;
 		index = 0;
 		cindex = 0;
+		cnext = NULL;
 		home = NULL;
 		collided = false;
 		critical_section = NULL;
+		command = antixtransfer::control_message::SPEED;
+		command_turns = 0;
+		sensed_epoch = 0;
+		// robots at rest are not moved, so may be sensed before any update
+		FovBBox( sensor_bbox );
+	}
+
+	/*
+		All changes to the sense matrix go through these, so each cell knows
+		when its contents last changed
+	*/
+	static void
+	cell_touch_robots(unsigned int index) {
+		matrix[index].robots_stamp = sense_epoch;
+	}
+
+	static void
+	cell_touch_pucks(unsigned int index) {
+		matrix[index].pucks_stamp = sense_epoch;
+	}
+
+	// a robot carrying a puck brings it along
+	static void
+	cell_add_robot(unsigned int index, Robot *r) {
+		matrix[index].robots.push_back( r );
+		cell_touch_robots(index);
+#if SENSE_OCCUPANCY
+		robots_occupied.set(index);
+#endif
+		if (r->has_puck)
+			cell_add_held(index);
+	}
+
+	static void
+	cell_remove_robot(unsigned int index, Robot *r) {
+		antix::EraseAll( r, matrix[index].robots );
+		cell_touch_robots(index);
+#if SENSE_OCCUPANCY
+		if (matrix[index].robots.empty())
+			robots_occupied.clear(index);
+#endif
+		if (r->has_puck)
+			cell_remove_held(index);
+	}
+
+	// a robot in the cell picked up / dropped a puck
+	static void
+	cell_add_held(unsigned int index) {
+		matrix[index].held_pucks++;
+		cell_touch_pucks(index);
+#if SENSE_OCCUPANCY
+		pucks_occupied.set(index);
+#endif
+	}
+
+	static void
+	cell_remove_held(unsigned int index) {
+		assert(matrix[index].held_pucks > 0);
+		matrix[index].held_pucks--;
+		cell_touch_pucks(index);
+#if SENSE_OCCUPANCY
+		if (matrix[index].pucks.empty() && matrix[index].held_pucks == 0)
+			pucks_occupied.clear(index);
+#endif
+	}
+
+	static void
+	cell_add_puck(unsigned int index, Puck *p) {
+		matrix[index].pucks.push_back( p );
+		cell_touch_pucks(index);
+#if SENSE_OCCUPANCY
+		pucks_occupied.set(index);
+#endif
+	}
+
+	static void
+	cell_remove_puck(unsigned int index, Puck *p) {
+		antix::EraseAll( p, matrix[index].pucks );
+		cell_touch_pucks(index);
+#if SENSE_OCCUPANCY
+		if (matrix[index].pucks.empty() && matrix[index].held_pucks == 0)
+			pucks_occupied.clear(index);
+#endif
 	}
 
 	void
@@ -197,13 +489,70 @@ public:
 		y = antix::rand_between(0, antix::world_size);
 	}
 
+	/*
+		Collision matrix. Each collision cell holds at most one robot. A
+		bucket's robots are a list through cnext
+	*/
+	static unsigned int
+	CBucket(unsigned int cx, unsigned int cy) {
+		return cx / COLLISION_BUCKET_CELLS + (cy / COLLISION_BUCKET_CELLS) * cbucket_width;
+	}
+
+	static unsigned int
+	CBucket(unsigned int cindex) {
+		return CBucket(cindex % antix::cmatrix_width, cindex / antix::cmatrix_width);
+	}
+
+	static void
+	size_cmatrix() {
+		cbucket_width = (antix::cmatrix_width + COLLISION_BUCKET_CELLS - 1) / COLLISION_BUCKET_CELLS;
+		cbuckets.assign(cbucket_width * cbucket_width, (Robot *) NULL);
+	}
+
+	// robot in collision cell cindex, or NULL
 	static Robot *
-	did_geom_collide(Robot *r, unsigned int cindex, double x, double y) {
-		if (cmatrix[cindex] == NULL || cmatrix[cindex] == r)
-			return NULL;
+	cell_occupant(unsigned int cindex) {
+		for (Robot *r = cbuckets[ CBucket(cindex) ]; r != NULL; r = r->cnext) {
+			if (r->cindex == cindex)
+				return r;
+		}
+		return NULL;
+	}
 
-		Robot *r2 = cmatrix[cindex];
+	// add r to the collision matrix at r->cindex
+	static void
+	cmatrix_add(Robot *r) {
+		assert( cell_occupant(r->cindex) == NULL );
+		Robot *&first = cbuckets[ CBucket(r->cindex) ];
+		r->cnext = first;
+		first = r;
+	}
 
+	static void
+	cmatrix_remove(Robot *r) {
+		Robot **link = &cbuckets[ CBucket(r->cindex) ];
+		while (*link != NULL && *link != r)
+			link = &(*link)->cnext;
+		assert(*link == r);
+		if (*link == r)
+			*link = r->cnext;
+		r->cnext = NULL;
+	}
+
+	static void
+	cmatrix_move(Robot *r, unsigned int new_cindex) {
+		if ( CBucket(new_cindex) == CBucket(r->cindex) ) {
+			assert( cell_occupant(new_cindex) == NULL || cell_occupant(new_cindex) == r );
+			r->cindex = new_cindex;
+			return;
+		}
+		cmatrix_remove(r);
+		r->cindex = new_cindex;
+		cmatrix_add(r);
+	}
+
+	static bool
+	geom_collide(const Robot *r2, double x, double y) {
 		const double max_range = robot_radius + robot_radius;
 
 		// can perhaps avoid subsequent checks by looking at dx, dy individually,
@@ -219,84 +568,73 @@ public:
 
 		const double squared_max_range = max_range * max_range;
 		const double dsq = dx*dx + dy*dy;
-		if ( dsq <= squared_max_range )
-			return r2;
-
-		return NULL;
+		return dsq <= squared_max_range;
 	}
 
 	/*
+		Check whether robot r collides if it's at x, y
+
 		If the target cindex is taken, definitely collided
 		Otherwise perform geometric collision checks on those cells around
 		the target cindex
 
-		Returns the robot we collided with, or NULL
+		Returns a robot we collided with, or NULL
 	*/
 	static Robot *
 	did_collide(Robot *r, unsigned int cindex, double x, double y) {
-		if (cmatrix[cindex] != NULL && cmatrix[cindex] != r)
-			return cmatrix[cindex];
-
-		const unsigned int c_x = antix::CCell_x(x);
-		const unsigned int c_y = antix::CCell_y(y);
-
 		const double ccell_length = 2*robot_radius;
 
-		const unsigned int top_left = antix::CCell(x - ccell_length, y - ccell_length);
-		const unsigned int top_centre = antix::CCell(x, y - ccell_length);
-		const unsigned int top_right = antix::CCell(x + ccell_length, y - ccell_length);
-
-		const unsigned int bottom_left = antix::CCell(x - ccell_length, y + ccell_length);
-		const unsigned int bottom_centre = antix::CCell(x, y + ccell_length);
-		const unsigned int bottom_right = antix::CCell(x + ccell_length, y + ccell_length);
-
-		const unsigned int left = antix::CCell(x - ccell_length, y);
-		const unsigned int right = antix::CCell(x + ccell_length, y);
-
-		const unsigned int cmatrix_size = antix::cmatrix_width * antix::cmatrix_width;
-
-		Robot *r2;
-
-		if (top_left < cmatrix_size) {
-			r2 = did_geom_collide(r, top_left, x, y);
-			if (r2 != NULL) return r2;
-		}
-
-		if (top_centre < cmatrix_size) {
-			r2 = did_geom_collide(r, top_centre, x, y);
-			if (r2 != NULL) return r2;
-		}
-
-		if (top_right < cmatrix_size) {
-			r2 = did_geom_collide(r, top_right, x, y);
-			if (r2 != NULL) return r2;
-		}
-
-		if (bottom_left < cmatrix_size) {
-			r2 = did_geom_collide(r, bottom_left, x, y);
-			if (r2 != NULL) return r2;
-		}
-
-		if (bottom_centre < cmatrix_size) {
-			r2 = did_geom_collide(r, bottom_centre, x, y);
-			if (r2 != NULL) return r2;
-		}
-
-		if (bottom_right < cmatrix_size) {
-			r2 = did_geom_collide(r, bottom_right, x, y);
-			if (r2 != NULL) return r2;
+		// the columns & rows around us, each found once
+		const unsigned int width = antix::cmatrix_width;
+		const unsigned int cols[3] = {
+			antix::CCell_x(x - ccell_length),
+			antix::CCell_x(x),
+			antix::CCell_x(x + ccell_length)
+		};
+		const unsigned int rows[3] = {
+			antix::CCell_y(y - ccell_length),
+			antix::CCell_y(y),
+			antix::CCell_y(y + ccell_length)
+		};
+		assert( cindex == cols[1] + rows[1] * width );
+
+		// the 8 cells around cindex
+		unsigned int around[8];
+		unsigned int n = 0;
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) {
+				if (i != 1 || j != 1)
+					around[n++] = cols[j] + rows[i] * width;
+			}
 		}
 
-		if (left < cmatrix_size) {
-			r2 = did_geom_collide(r, left, x, y);
-			if (r2 != NULL) return r2;
+		// buckets holding those cells: 2 x 2 but for a partial last bucket
+		// where the matrix wraps
+		unsigned int bucket_cols[3],
+			bucket_rows[3];
+		unsigned int num_bucket_cols = 0,
+			num_bucket_rows = 0;
+		for (int i = 0; i < 3; i++) {
+			const unsigned int bc = cols[i] / COLLISION_BUCKET_CELLS;
+			if ( find(bucket_cols, bucket_cols + num_bucket_cols, bc) == bucket_cols + num_bucket_cols )
+				bucket_cols[num_bucket_cols++] = bc;
+			const unsigned int br = rows[i] / COLLISION_BUCKET_CELLS;
+			if ( find(bucket_rows, bucket_rows + num_bucket_rows, br) == bucket_rows + num_bucket_rows )
+				bucket_rows[num_bucket_rows++] = br;
 		}
 
-		if (right < cmatrix_size) {
-			r2 = did_geom_collide(r, right, x, y);
-			if (r2 != NULL) return r2;
+		for (unsigned int i = 0; i < num_bucket_rows; i++) {
+			for (unsigned int j = 0; j < num_bucket_cols; j++) {
+				for (Robot *r2 = cbuckets[ bucket_cols[j] + bucket_rows[i] * cbucket_width ]; r2 != NULL; r2 = r2->cnext) {
+					if (r2 == r)
+						continue;
+					if (r2->cindex == cindex)
+						return r2;
+					if ( find(around, around + 8, r2->cindex) != around + 8 && geom_collide(r2, x, y) )
+						return r2;
+				}
+			}
 		}
-
 		return NULL;
 	}
 
@@ -324,15 +662,51 @@ public:
 #if DEBUG
 		cout << "Updating pose of robot " << id << " team " << team << endl;
 #endif
-		const double dx = v * antix::fast_cos(a);
-		const double dy = v * antix::fast_sin(a);
-		const double da = w;
+#if SKIP_IDLE
+		if (idle())
+			return;
+#endif
+		coord_t new_x,
+			new_y,
+			new_a;
+		antix::propose_pose<coord_t>(x, y, a, v, w, new_x, new_y, new_a);
+		move_to(new_x, new_y, new_a);
+	}
 
-		// always update angle even if we don't move
-		a = antix::AngleNormalize(a + da);
+	/*
+		update_pose() with the new pose already proposed (by
+		antix::propose_poses())
+	*/
+	void
+	update_pose(const coord_t new_x, const coord_t new_y, const coord_t new_a) {
+#if SKIP_IDLE
+		if (idle())
+			return;
+#endif
+		move_to(new_x, new_y, new_a);
+	}
+
+#if SKIP_IDLE
+	/*
+		Whether an update would change nothing: we would stay put, and no robot
+		can have come within collision range since our last check found none.
+		Robots that move check against us, and foreign robots only come near
+		robots in critical sections
+	*/
+	bool
+	idle() const {
+		return v == 0 && w == 0 && !collided && critical_section == NULL;
+	}
+#endif
 
-		double new_x = antix::DistanceNormalize(x + dx);
-		double new_y = antix::DistanceNormalize(y + dy);
+	/*
+		Second half of update_pose(): move to the proposed pose unless we
+		collide there, and keep the matrices up to date
+	*/
+	void
+	move_to(const coord_t new_x, const coord_t new_y, const coord_t new_a) {
+		// always update angle even if we don't move
+		a = new_a;
 
 		/*
 			Collision matrix stuff
@@ -340,16 +714,15 @@ public:
 #if COLLISIONS
 		unsigned int new_cindex = antix::CCell(new_x, new_y);
 
-		collided = false;
-
 		// we try to move to a new collision cell
 		if (new_cindex != cindex) {
 			// if it's occupied, we can't move there. Disallow move
-			if ( cmatrix[new_cindex] != NULL ) {
+			Robot *occupant = cell_occupant(new_cindex);
+			if ( occupant != NULL ) {
 				// we collide
 				collide();
 				// other robot also collides
-				cmatrix[new_cindex]->collide();
+				occupant->collide();
 
 				return;
 			}
@@ -365,48 +738,27 @@ public:
 			return;
 		}
 
-		// remove from old cindex
-		if (cindex != new_cindex) {
-			cmatrix[cindex] = NULL;
-		}
-
-		cindex = new_cindex;
-		cmatrix[cindex] = this;
+		cmatrix_move(this, new_cindex);
 #endif
 
 		x = new_x;
 		y = new_y;
 
 		/*
-			Sensor matrix stuff	
+			Sensor matrix stuff. A puck we hold comes with us
 		*/
 		const unsigned int new_index = antix::Cell( x, y );
 
-		// If we're holding a puck, it must move also
-		if (has_puck) {
-			assert(puck != NULL);
-			assert(puck->robot == this);
-			assert(puck->held == true);
-			puck->x = x;
-			puck->y = y;
-		}
-
 		if (new_index != index ) {
-			antix::EraseAll( this, matrix[index].robots );
-			matrix[new_index].robots.push_back( this );
-
-			if (has_puck) {
-#if DEBUG_ERASE_PUCK
-				cout << "EraseAll puck #1 in update_pose()" << endl;
-#endif
-				antix::EraseAll( puck, matrix[index].pucks );
-				matrix[new_index].pucks.push_back( puck );
-				puck->index = new_index;
-			}
+			cell_remove_robot( index, this );
+			cell_add_robot( new_index, this );
 			index = new_index;
+		} else {
+			// moved within the cell
+			cell_touch_robots( index );
+			if (has_puck)
+				cell_touch_pucks( index );
 		}
-
-		FovBBox( sensor_bbox );
 	}
 
 	// from rtv's Antix
@@ -456,6 +808,77 @@ public:
 		last_y = new_last_y;
 	}
 
+	/*
+		Update only the speed, when robot's memory is held by the client
+	*/
+	void
+	setspeed(double new_v, double new_w) {
+		v = new_v;
+		w = new_w;
+	}
+
+	/*
+		Start a motion primitive at speed new_v
+	*/
+	void
+	set_command(int new_command, double new_v, double new_target_x, double new_target_y, double new_target_a) {
+		resume_command(new_command, new_v, new_target_x, new_target_y, new_target_a, PRIMITIVE_MAX_TURNS);
+		// only a collision from here on ends the primitive
+		collided = false;
+	}
+
+	/*
+		Carry on with a primitive started elsewhere (on the node we came from)
+	*/
+	void
+	resume_command(int new_command, double new_v, double new_target_x, double new_target_y, double new_target_a, int turns) {
+		command = new_command;
+		cruise_v = new_v;
+		target_x = new_target_x;
+		target_y = new_target_y;
+		target_a = new_target_a;
+		command_turns = turns;
+	}
+
+	/*
+		Primitive is over: wait for the client's next command
+	*/
+	void
+	stop_command() {
+		command = antixtransfer::control_message::SPEED;
+		v = 0;
+		w = 0;
+	}
+
+	/*
+		Set v/w to turn towards the heading and drive along it
+	*/
+	void
+	steer_heading(double heading) {
+		const double heading_error = antix::AngleNormalize(heading - a);
+		if ( fabs(heading_error) < PRIMITIVE_HEADING_TOLERANCE ) {
+			v = cruise_v;
+			w = 0.0;
+		} else {
+			v = cruise_v / PRIMITIVE_TURN_SLOWDOWN;
+			w = PRIMITIVE_TURN_GAIN * heading_error;
+		}
+	}
+
+	/*
+		Set v/w to drive towards (to_x, to_y)
+		Returns true if we are already there (within a step)
+	*/
+	bool
+	steer_to(double to_x, double to_y) {
+		const double dx( antix::WrapDistance( to_x - x ) );
+		const double dy( antix::WrapDistance( to_y - y ) );
+		if ( hypot(dx, dy) <= cruise_v )
+			return true;
+		steer_heading( antix::fast_atan2(dy, dx) );
+		return false;
+	}
+
 	/*
 		Attempt to pick up a puck near the robot
 	*/
@@ -494,15 +917,12 @@ public:
 				puck->held = true;
 				puck->robot = this;
 
-				// ensure puck is in our same cell
-				if (puck->index != index) {
+				// out of the sense matrix: we carry it
 #if DEBUG_ERASE_PUCK
-					cout << "EraseAll puck #1 in pickup()" << endl;
+				cout << "EraseAll puck #1 in pickup()" << endl;
 #endif
-					antix::EraseAll( puck, matrix[puck->index].pucks );
-					matrix[index].pucks.push_back( puck );
-					puck->index = index;
-				}
+				cell_remove_puck( puck->index, puck );
+				cell_add_held( index );
 
 				// if puck is in a home, disassociate it from that home
 				if (puck->home != NULL) {
@@ -575,10 +995,15 @@ public:
 		assert(puck->robot == this);
 		assert(puck->held == true);
 		
-		// free it
+		// free it, back into the sense matrix where we are
 		has_puck = false;
 		puck->held = false;
 		puck->robot = NULL;
+		puck->x = x;
+		puck->y = y;
+		puck->index = index;
+		cell_remove_held( index );
+		cell_add_puck( index, puck );
 		// store reference so as to check puck location further down
 		Puck *p = puck;
 		puck = NULL;
@@ -599,12 +1024,69 @@ public:
 	}
 };
 
+/*
+	A robot's state before one update_pose(), so the update can be undone
+	(SPECULATIVE_BORDER)
+*/
+class PoseCheckpoint {
+public:
+	Robot *r;
+	coord_t x,
+		y,
+		a;
+	double v,
+		w;
+	bool collided;
+	unsigned int index,
+		cindex;
+	bbox_t sensor_bbox;
+
+	// robot in the cell r moves to, which update_pose() will collide(), and
+	// its state before
+	Robot *other;
+	coord_t other_a;
+	double other_v,
+		other_w;
+	bool other_collided;
+
+	PoseCheckpoint(Robot *r) : r(r), x(r->x), y(r->y), a(r->a), v(r->v), w(r->w),
+		collided(r->collided), index(r->index), cindex(r->cindex), sensor_bbox(r->sensor_bbox) {
+
+		other = NULL;
+#if COLLISIONS
+		// same target cell as update_pose() finds
+		coord_t new_x,
+			new_y,
+			new_a;
+		antix::propose_pose<coord_t>(x, y, a, v, w, new_x, new_y, new_a);
+		const unsigned int new_cindex = antix::CCell(new_x, new_y);
+		if (new_cindex != cindex && Robot::cell_occupant(new_cindex) != NULL) {
+			other = Robot::cell_occupant(new_cindex);
+			other_a = other->a;
+			other_v = other->v;
+			other_w = other->w;
+			other_collided = other->collided;
+		}
+#endif
+	}
+};
+
 double Robot::pickup_range;
 double Robot::fov;
 double Robot::vision_range;
 double Robot::vision_range_squared;
 double Robot::robot_radius;
 vector<MatrixCell> Robot::matrix;
-vector<Robot *> Robot::cmatrix;
+#if SENSE_OCCUPANCY
+Occupancy Robot::robots_occupied;
+Occupancy Robot::pucks_occupied;
+#endif
+vector<Robot *> Robot::cbuckets;
+unsigned int Robot::cbucket_width;
+unsigned int Robot::sense_epoch = 1;
+#if ROBOT_POOL
+vector<void *> RobotPool::free_slots;
+size_t RobotPool::object_size = 0;
+#endif
 
 #endif
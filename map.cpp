@@ -18,6 +18,95 @@
 #define BOTS_TEAM_SIZE 1000
 #define BOTS_ROBOT_SIZE 11000
 
+// for ViewCone::classify()
+#define CELL_OUTSIDE 0
+#define CELL_INSIDE 1
+#define CELL_PARTIAL 2
+
+/*
+	A robot's vision sector, for finding which sense matrix cells lie wholly
+	inside or outside it. Edges are lines through the robot: the sector
+	widened by SENSE_CONE_MARGIN on each side, and narrowed by it
+*/
+class ViewCone {
+public:
+	double x, y;
+	double outer_left_x, outer_left_y,
+		outer_right_x, outer_right_y,
+		inner_left_x, inner_left_y,
+		inner_right_x, inner_right_y;
+	// sectors of half a turn or more are not the meeting of two half planes
+	bool usable;
+	// narrowed sector is empty
+	bool inner_empty;
+
+	ViewCone(Robot *r) : x(r->x), y(r->y) {
+		const double outer = Robot::fov/2.0 + SENSE_CONE_MARGIN;
+		const double inner = Robot::fov/2.0 - SENSE_CONE_MARGIN;
+		usable = outer < M_PI/2.0;
+		inner_empty = inner <= 0;
+
+		outer_left_x = cos(r->a + outer);
+		outer_left_y = sin(r->a + outer);
+		outer_right_x = cos(r->a - outer);
+		outer_right_y = sin(r->a - outer);
+		inner_left_x = cos(r->a + inner);
+		inner_left_y = sin(r->a + inner);
+		inner_right_x = cos(r->a - inner);
+		inner_right_y = sin(r->a - inner);
+	}
+
+	/*
+		Whether the sense matrix cell at x, y (y unwrapped) is wholly outside
+		the sector, wholly inside it, or neither. Inside/outside hold for
+		entity bearings found with fast_atan2() as its error is under the margin
+	*/
+	int
+	classify(int cell_x, int cell_y) const {
+		if (!usable || cell_x < 0 || cell_x >= (int) antix::matrix_height)
+			return CELL_PARTIAL;
+
+		const double cell_size = antix::vision_grid.cell_size;
+		// allow for rounding in which cell an entity is put
+		const double eps = cell_size * 1e-9;
+		const double min_x = cell_x * cell_size - x - eps;
+		const double max_x = (cell_x + 1) * cell_size - x + eps;
+		const double min_y = cell_y * cell_size - y - eps;
+		const double max_y = (cell_y + 1) * cell_size - y + eps;
+
+		// nearest point of the cell out of range
+		const double near_x = max( min_x, min(0.0, max_x) );
+		const double near_y = max( min_y, min(0.0, max_y) );
+		if (near_x*near_x + near_y*near_y > Robot::vision_range_squared)
+			return CELL_OUTSIDE;
+
+		const double corners_x[4] = { min_x, max_x, min_x, max_x };
+		const double corners_y[4] = { min_y, min_y, max_y, max_y };
+		bool all_left = true,
+			all_right = true,
+			all_inside = !inner_empty;
+		for (int i = 0; i < 4; i++) {
+			const double cx = corners_x[i];
+			const double cy = corners_y[i];
+			// cross products with the edges: > 0 is left of an edge
+			if (outer_left_x * cy - outer_left_y * cx <= 0)
+				all_left = false;
+			if (outer_right_x * cy - outer_right_y * cx >= 0)
+				all_right = false;
+			if (cx*cx + cy*cy > Robot::vision_range_squared
+				|| inner_left_x * cy - inner_left_y * cx >= 0
+				|| inner_right_x * cy - inner_right_y * cx <= 0)
+				all_inside = false;
+		}
+
+		if (all_left || all_right)
+			return CELL_OUTSIDE;
+		if (all_inside)
+			return CELL_INSIDE;
+		return CELL_PARTIAL;
+	}
+};
+
 using namespace std;
 
 class Map {
@@ -29,6 +118,8 @@ public:
 
 	// the robots & pucks we control
 	vector<Puck *> pucks; //TODO: might be able to remove this
+	// pucks of robots that moved away, reused for those arriving with one
+	vector<Puck *> spare_pucks;
 	vector<Robot *> robots; //TODO: remove this
 	// sent to us by neighbours
 	vector<Puck> foreign_pucks;
@@ -43,6 +134,26 @@ public:
 	// indices into cindex that have foreign robots
 	// we keep this for a turn until after update_poses()
 	vector<Robot *> foreign_critical_robots;
+	// foreign robots placed for moving our left critical region robots
+	vector<Robot *> left_ghosts;
+
+#if BATCH_POSES
+	// update_poses(): poses & speeds of robots outside critical sections,
+	// and where antix::propose_poses() would move them
+	vector<double> batch_x, batch_y, batch_a, batch_v, batch_w;
+	vector<double> proposed_x, proposed_y, proposed_a;
+#endif
+
+#if SPECULATIVE_BORDER
+	// robots in left neighbour's right critical section as of its last reply
+	vector<pair<double, double> > spec_left_ghosts;
+	// each left critical region robot's state before its speculative update
+	vector<PoseCheckpoint> spec_journal;
+	// turns the guess was right / wrong, and robots updated again
+	int spec_hits,
+		spec_misses,
+		spec_redone;
+#endif
 
 	// We need to know homes to set robot's first last_x, last_y
 	vector<Home *> all_homes;
@@ -54,10 +165,27 @@ public:
 	// what each robot can see by team
 	map<int, antixtransfer::sense_data *> sense_map;
 
+	// by team: control period given by the team's client. 1 if not given
+	map<int, int> control_periods;
+
+#if SENSE_DELTA
+	// teams that get everything next turn as they may have missed a message
+	set<int> keyframe_teams;
+#endif
+
+#if SENSE_NEIGHBOUR_LISTS
+	// robots / pucks were added or removed since neighbour lists were built
+	bool neighbour_lists_stale;
+	int neighbour_list_builds;
+#endif
+
 	~Map() {
 		for (vector<Puck *>::iterator it = pucks.begin(); it != pucks.end(); it++) {
 			delete *it;
 		}
+		for (vector<Puck *>::iterator it = spare_pucks.begin(); it != spare_pucks.end(); it++) {
+			delete *it;
+		}
 		for (vector<Robot *>::iterator it = robots.begin(); it != robots.end(); it++) {
 			delete *it;
 		}
@@ -80,26 +208,30 @@ public:
 		my_max_x = my_min_x + antix::offset_size;
 		antix::my_min_x = my_min_x;
 
+#if SPECULATIVE_BORDER
+		spec_hits = 0;
+		spec_misses = 0;
+		spec_redone = 0;
+#endif
+#if SENSE_NEIGHBOUR_LISTS
+		neighbour_lists_stale = true;
+		neighbour_list_builds = 0;
+#endif
+
 		for (int i = 0; i < BOTS_TEAM_SIZE; i++) {
 			for (int j = 0; j < BOTS_ROBOT_SIZE; j++) {
 				bots[i][j] = NULL;
 			}
 		}
 
-		// + 1000 as our calculations not exact in some places. Rounding error or?
-		//Robot::matrix.resize(antix::matrix_width * antix::matrix_height + 1000);
-		Robot::matrix.resize(antix::matrix_height * antix::matrix_height + 1000);
-		cout << "Vision matrix has " << Robot::matrix.size() << " cells" << endl;
+		size_matrix();
 
 #if COLLISIONS
 		// size of cell in one dimension
 		double collision_cell_size = 2 * Robot::robot_radius;
-		antix::cmatrix_width = ceil(antix::world_size / collision_cell_size);
-		Robot::cmatrix.resize(antix::cmatrix_width * antix::cmatrix_width);
-		for (vector<Robot *>::iterator it = Robot::cmatrix.begin(); it != Robot::cmatrix.end(); it++) {
-			*it = NULL;
-		}
-		cout << "Collision matrix has " << Robot::cmatrix.size() << " cells." << endl;
+		antix::set_collision_grid( ceil(antix::world_size / collision_cell_size) );
+		Robot::size_cmatrix();
+		cout << "Collision matrix has " << antix::cmatrix_width * antix::cmatrix_width << " cells in " << Robot::cbuckets.size() << " buckets." << endl;
 #endif
 
 		cout << "Set dimensions of this map. Min x: " << my_min_x << " Max x: " << my_max_x << endl;
@@ -108,6 +240,120 @@ public:
 		generate_pucks(initial_puck_amount);
 	}
 
+	/*
+		Height (and width) of the vision matrix with cells_per_range cells per
+		vision_range, keeping under MAX_VISION_CELLS cells
+	*/
+	static unsigned int
+	matrix_height_for(const double cells_per_range) {
+		double height = floor(antix::world_size * cells_per_range / Robot::vision_range);
+		height = min( height, floor( sqrt( (double) MAX_VISION_CELLS ) ) );
+		return max( height, 1.0 );
+	}
+
+	/*
+		Make an empty vision matrix of antix::matrix_height cells square.
+		Sensor bboxes reach up to vision_range past the last column, so the
+		last row has that many cells more
+	*/
+	void
+	size_matrix() {
+		const double cell_size = antix::vision_grid.cell_size;
+		const unsigned int padding = ceil(Robot::vision_range / cell_size) + 1;
+
+		Robot::matrix.clear();
+		Robot::matrix.resize(antix::matrix_height * antix::matrix_height + padding);
+#if SENSE_OCCUPANCY
+		Robot::robots_occupied.resize( Robot::matrix.size() );
+		Robot::pucks_occupied.resize( Robot::matrix.size() );
+#endif
+		cout << "Vision matrix has " << Robot::matrix.size() << " cells" << endl;
+	}
+
+	/*
+		Size the vision matrix for cells_per_range cells per vision_range and
+		put our robots & pucks back in it
+	*/
+	void
+	rebuild_matrix(const double cells_per_range) {
+		antix::set_vision_grid( matrix_height_for(cells_per_range) );
+		size_matrix();
+
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			(*it)->index = antix::Cell( (*it)->x, (*it)->y );
+			Robot::cell_add_robot( (*it)->index, *it );
+			// what it saw was found with other cells
+			(*it)->sensed_epoch = 0;
+		}
+		// held pucks came with their robots
+		vector<Puck *>::const_iterator pucks_end = pucks.end();
+		for (vector<Puck *>::const_iterator it = pucks.begin(); it != pucks_end; it++) {
+			if ( (*it)->held )
+				continue;
+			(*it)->index = antix::Cell( (*it)->x, (*it)->y );
+			Robot::cell_add_puck( (*it)->index, *it );
+		}
+#if SENSE_NEIGHBOUR_LISTS
+		neighbour_lists_stale = true;
+#endif
+	}
+
+	/*
+		Choose cells per vision_range by timing sensing of our robots with each
+		of a few, and rebuild the vision matrix with the fastest. Finer cells
+		pay off in dense worlds and coarser in sparse ones
+	*/
+	void
+	calibrate_matrix() {
+		const double candidates[] = { 0.5, 1, 2, 3, 4 };
+		const int candidates_count = sizeof(candidates) / sizeof(candidates[0]);
+		double best = 1,
+			best_time = -1;
+
+		for (int i = 0; i < candidates_count; i++) {
+			rebuild_matrix( candidates[i] );
+			const double time = time_sensing( VISION_CALIBRATION_RUNS );
+			cout << "Vision matrix calibration: " << candidates[i] << " cells per vision range, "
+				<< antix::matrix_height << " cells high: " << time << " ms" << endl;
+			if (best_time < 0 || time < best_time) {
+				best = candidates[i];
+				best_time = time;
+			}
+		}
+
+		rebuild_matrix( best );
+		cout << "Using " << best << " vision matrix cells per vision range" << endl;
+	}
+
+	/*
+		Milliseconds to find what all our robots see runs times. No sense
+		messages are built, so nothing is changed for clients
+	*/
+	double
+	time_sensing(const int runs) {
+		antixtransfer::sense_data::Robot scratch;
+		const double start = antix::now_ms();
+
+		for (int i = 0; i < runs; i++) {
+			Robot::sense_epoch++;
+#if SENSE_NEIGHBOUR_LISTS
+			neighbour_lists_stale = true;
+			check_neighbour_lists();
+#endif
+#if SENSE_SYMMETRIC_PAIRS
+			sense_robot_pairs();
+#endif
+			vector<Robot *>::const_iterator robots_end = robots.end();
+			for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+				(*it)->sensed_epoch = 0;
+				scratch.Clear();
+				sense_robot( *it, &scratch );
+			}
+		}
+		return antix::now_ms() - start;
+	}
+
 	/*
 		There is a list of homes & their locations in node list.
 		Use it to populate our home list
@@ -188,7 +434,7 @@ public:
 						cindex = antix::CCell(r->x, r->y);
 					}
 					r->cindex = cindex;
-					Robot::cmatrix[r->cindex] = r;
+					Robot::cmatrix_add(r);
 #endif
 
 					// bots[][] array
@@ -202,7 +448,7 @@ public:
 					// sensor matrix
 					unsigned int index = antix::Cell(r->x, r->y);
 					r->index = index;
-					Robot::matrix[index].robots.push_back( r );
+					Robot::cell_add_robot( index, r );
 
 #if DEBUG
 					cout << "Created a bot: Team: " << r->team << " id: " << r->id << " at (" << r->x << ", " << r->y << ")" << endl;
@@ -229,7 +475,7 @@ public:
 		// only add in cell when we find one we're staying in
 		unsigned int index = antix::Cell(p->x, p->y);
 		p->index = index;
-		Robot::matrix[index].pucks.push_back( p );
+		Robot::cell_add_puck( index, p );
 	}
 
 	/*
@@ -338,6 +584,7 @@ public:
 		r->v = v;
 		r->w = w;
 		r->has_puck = has_puck;
+		r->FovBBox( r->sensor_bbox );
 
 #if COLLISIONS
 		// collision matrix
@@ -347,14 +594,14 @@ public:
 		if (r2 != NULL) {
 			// Collide our local robot
 			// XXX ?
-			//Robot::cmatrix[new_cindex]->collide();
+			//Robot::cell_occupant(new_cindex)->collide();
 			delete r;
 			return NULL;
 		}
 
 		// Cell is free
 		r->cindex = new_cindex;
-		Robot::cmatrix[new_cindex] = r;
+		Robot::cmatrix_add(r);
 #endif
 
 		// Place in critical section if necessary
@@ -381,22 +628,29 @@ public:
 		// vector of all robots
 		robots.push_back(r);
 
-		// sensor matrix
+		// sensor matrix. A puck the robot carries comes with it
 		unsigned int new_index = antix::Cell( x, y );
 		r->index = new_index;
-		Robot::matrix[new_index].robots.push_back( r );
+		Robot::cell_add_robot( new_index, r );
+#if SENSE_NEIGHBOUR_LISTS
+		neighbour_lists_stale = true;
+#endif
 
 		// If the robot is carrying a puck, we have to add a puck to our records
 		if (r->has_puck) {
-			Puck *p = new Puck(r->x, r->y, true);
+			Puck *p;
+			if (spare_pucks.empty()) {
+				p = new Puck(r->x, r->y, true);
+			} else {
+				p = spare_pucks.back();
+				spare_pucks.pop_back();
+				*p = Puck(r->x, r->y, true);
+			}
 			p->robot = r;
 			pucks.push_back(p);
 
 			r->puck = p;
 
-			p->index = new_index;
-			Robot::matrix[new_index].pucks.push_back( p );
-
 			assert(r->has_puck == true);
 			assert(r->puck->robot == r);
 			assert(p->robot == r);
@@ -421,12 +675,23 @@ public:
 		r_move->set_v(r->v);
 		r_move->set_w(r->w);
 		r_move->set_has_puck(r->has_puck);
-		r_move->set_last_x(r->last_x);
-		r_move->set_last_y(r->last_y);
+		r_move->set_collided(r->collided);
 		r_move->set_bbox_x_min(r->sensor_bbox.x.min);
 		r_move->set_bbox_x_max(r->sensor_bbox.x.max);
 		r_move->set_bbox_y_min(r->sensor_bbox.y.min);
 		r_move->set_bbox_y_max(r->sensor_bbox.y.max);
+		if (r->command != antixtransfer::control_message::SPEED) {
+			r_move->set_command(r->command);
+			r_move->set_target_x(r->target_x);
+			r_move->set_target_y(r->target_y);
+			r_move->set_target_a(r->target_a);
+			r_move->set_cruise_v(r->cruise_v);
+			r_move->set_command_turns(r->command_turns);
+		}
+
+#if !CLIENT_MEMORY
+		r_move->set_last_x(r->last_x);
+		r_move->set_last_y(r->last_y);
 
 		vector<int>::const_iterator ints_end = r->ints.end();
 		for (vector<int>::const_iterator it = r->ints.begin(); it != ints_end; it++)
@@ -434,6 +699,7 @@ public:
 		vector<double>::const_iterator doubles_end = r->doubles.end();
 		for (vector<double>::const_iterator it = r->doubles.begin(); it != doubles_end; it++)
 			r_move->add_doubles( *it );
+#endif
 #if DEBUG
 		cout << "Moving robot with a " << r->a << " w " << r->w << " (Turn " << antix::turn << ")" << endl;
 #endif
@@ -456,11 +722,8 @@ public:
 
 		assert(r->puck->home == NULL);
 
-		// remove puck from cell
-#if DEBUG_ERASE_PUCK
-		cout << "EraseAll puck #1 in remove_puck()" << endl;
-#endif
-		antix::EraseAll( r->puck, Robot::matrix[ r->puck->index ].pucks );
+		// the robot's cell no longer has its puck
+		Robot::cell_remove_held( r->index );
 
 		// remove puck from vector
 		// XXX expensive
@@ -470,9 +733,12 @@ public:
 		antix::EraseAll( r->puck, pucks );
 		
 		// remove record on robot to deleted puck
-		delete r->puck;
+		spare_pucks.push_back( r->puck );
 		r->puck = NULL;
 		r->has_puck = false;
+#if SENSE_NEIGHBOUR_LISTS
+		neighbour_lists_stale = true;
+#endif
 	}
 
 	/*
@@ -494,14 +760,14 @@ public:
 
 #if COLLISIONS
 		// from collision matrix
-		assert(Robot::cmatrix[r->cindex] == r);
-		if (Robot::cmatrix[r->cindex] == r) {
-			Robot::cmatrix[r->cindex] = NULL;
-		}
+		Robot::cmatrix_remove(r);
 #endif
 
 		// from sense matrix
-		antix::EraseAll( r, Robot::matrix[r->index].robots );
+		Robot::cell_remove_robot( r->index, r );
+#if SENSE_NEIGHBOUR_LISTS
+		neighbour_lists_stale = true;
+#endif
 
 		// delete robot from memory
 		delete r;
@@ -517,6 +783,15 @@ public:
 	*/
 	void
 	build_sense_messages() {
+		// changes to cells from now on are newer than what we find here
+		Robot::sense_epoch++;
+#if SENSE_NEIGHBOUR_LISTS
+		check_neighbour_lists();
+#endif
+#if SENSE_SYMMETRIC_PAIRS
+		sense_robot_pairs();
+#endif
+
 		// clear old sense data
 		map<int, antixtransfer::sense_data *>::iterator sense_map_end = sense_map.end();
 #ifndef NDEBUG
@@ -531,6 +806,11 @@ public:
 		assert(sense_map_count == sense_map.size());
 		sense_map.clear();
 
+#if SENSE_DELTA
+		// periodically send everything so clients can resync
+		const bool keyframe = antix::turn % SENSE_KEYFRAME_TURNS == 0;
+#endif
+
 		// for every robot we have, build a message for it containing what it sees
 		vector<Robot *>::const_iterator robots_end = robots.end();
 #ifndef NDEBUG
@@ -541,6 +821,17 @@ public:
 #ifndef NDEBUG
 			robot_count++;
 #endif
+			// team is not controlled this turn: its robots carry on as they are
+			if ( !team_due( (*r)->team ) )
+				continue;
+			// node is driving this robot until its primitive is over
+			if ( (*r)->command != antixtransfer::control_message::SPEED ) {
+#if SENSE_DELTA
+				// client forgets robots left out, so send it all once it is back
+				(*r)->sent.valid = false;
+#endif
+				continue;
+			}
 
 			// if we already have an in progress sense msg for this team, use that
 			if (sense_map.count( (*r)->team ) > 0) {
@@ -548,37 +839,46 @@ public:
 			// otherwise make a new one and use it
 			} else {
 				team_msg = new antixtransfer::sense_data;
+#if SENSE_DELTA
+				team_msg->set_keyframe( keyframe || keyframe_teams.count( (*r)->team ) > 0 );
+#endif
 				sense_map.insert( pair<int, antixtransfer::sense_data *>((*r)->team, team_msg) );
 			}
 
 			// create entry for this robot since it's first time we're looking at it
 			antixtransfer::sense_data::Robot *robot_pb = team_msg->add_robot();
+			robot_pb->set_id( (*r)->id );
+#if SENSE_DELTA
+			add_pose_delta(*r, robot_pb, team_msg->keyframe());
+#else
 			robot_pb->set_a( (*r)->a );
 			robot_pb->set_x( (*r)->x );
 			robot_pb->set_y( (*r)->y );
 			robot_pb->set_has_puck( (*r)->has_puck );
-			robot_pb->set_id( (*r)->id );
+			robot_pb->set_collided( (*r)->collided );
+#if !CLIENT_MEMORY
 			robot_pb->set_last_x( (*r)->last_x );
 			robot_pb->set_last_y( (*r)->last_y );
-			robot_pb->set_collided( (*r)->collided );
+#endif
+#endif
+			// the client has now heard of the collision
+			(*r)->collided = false;
 
+#if !CLIENT_MEMORY
 			vector<int>::const_iterator ints_end = (*r)->ints.end();
 			for (vector<int>::const_iterator it = (*r)->ints.begin(); it != ints_end; it++)
 				robot_pb->add_ints( *it );
 			vector<double>::const_iterator doubles_end = (*r)->doubles.end();
 			for (vector<double>::const_iterator it = (*r)->doubles.begin(); it != doubles_end; it++)
 				robot_pb->add_doubles( *it );
+#endif
 
-			// we will now find what robots & pucks we can see, but before that,
-			// clear our see_pucks (and see_robots when we care...)
-			(*r)->see_pucks.clear();
-
-			const int lastx( antix::CellNoWrap_x( (*r)->sensor_bbox.x.max) );
-			const int lasty( antix::CellNoWrap_y( (*r)->sensor_bbox.y.max) );
+			// find what robots & pucks we can see
+			sense_robot(*r, robot_pb);
 
-			for (int x = antix::CellNoWrap_x( (*r)->sensor_bbox.x.min); x <= lastx; x++)
-				for (int y = antix::CellNoWrap_y( (*r)->sensor_bbox.y.min); y <= lasty; y++)
-					UpdateSensorsCell(x, y, *r, robot_pb);
+#if SENSE_DELTA
+			seen_delta(*r, robot_pb, team_msg->keyframe());
+#endif
 
 			// now look at foreign robots
 			/* XXX right now we don't care about foreign robots
@@ -642,11 +942,635 @@ public:
 			*/
 		}
 		assert(robot_count == robots.size());
+#if SENSE_DELTA
+		keyframe_teams.clear();
+#endif
 #if DEBUG
 		cout << "Sensors re-calculated." << endl;
 #endif
 	}
 	
+	/*
+		Sort robots & pucks along a Morton curve over their vision matrix cells,
+		so loops over them touch nearby cells of the matrices one after another
+	*/
+	void
+	spatial_reorder() {
+		vector<pair<uint64_t, Robot *> > robot_keys;
+		robot_keys.reserve( robots.size() );
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			const unsigned int index = (*it)->index;
+			robot_keys.push_back( pair<uint64_t, Robot *>(antix::morton(index % antix::matrix_height, index / antix::matrix_height), *it) );
+		}
+		sort( robot_keys.begin(), robot_keys.end() );
+		for (unsigned int i = 0; i < robot_keys.size(); i++)
+			robots[i] = robot_keys[i].second;
+
+		vector<pair<uint64_t, Puck *> > puck_keys;
+		puck_keys.reserve( pucks.size() );
+		vector<Puck *>::const_iterator pucks_end = pucks.end();
+		for (vector<Puck *>::const_iterator it = pucks.begin(); it != pucks_end; it++) {
+			// a held puck's own index is stale: it is where its robot is
+			const unsigned int index = (*it)->held ? (*it)->robot->index : (*it)->index;
+			puck_keys.push_back( pair<uint64_t, Puck *>(antix::morton(index % antix::matrix_height, index / antix::matrix_height), *it) );
+		}
+		sort( puck_keys.begin(), puck_keys.end() );
+		for (unsigned int i = 0; i < puck_keys.size(); i++)
+			pucks[i] = puck_keys[i].second;
+	}
+
+	/*
+		Set v/w for robots carrying out motion primitives, and stop those whose
+		primitive is done
+	*/
+	void
+	run_commands() {
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			Robot *r = *it;
+			if (r->command == antixtransfer::control_message::SPEED)
+				continue;
+
+			if (r->command_turns <= 0) {
+				r->stop_command();
+				continue;
+			}
+			r->command_turns--;
+
+			if (r->command == antixtransfer::control_message::GOTO) {
+				if ( r->steer_to(r->target_x, r->target_y) )
+					r->stop_command();
+
+			} else if (r->command == antixtransfer::control_message::HEADING_UNTIL_COLLISION) {
+				r->steer_heading(r->target_a);
+
+			} else if (r->command == antixtransfer::control_message::HOME_AND_DROP) {
+				Home *h = find_robot_home(r->team);
+				if (!r->has_puck || h == NULL) {
+					r->stop_command();
+					continue;
+				}
+				// drop well inside the home
+				const double dx( antix::WrapDistance( h->x - r->x ) );
+				const double dy( antix::WrapDistance( h->y - r->y ) );
+				if ( hypot(dx, dy) < antix::home_radius / 2 ) {
+					r->drop(&pucks, &local_homes);
+					r->stop_command();
+				} else {
+					r->steer_to(h->x, h->y);
+				}
+			}
+		}
+	}
+
+	/*
+		A collision ends any primitive. Called once this turn's poses are
+		updated and before sensing, so the client is sent collided with the
+		robot it gets back
+	*/
+	void
+	end_collided_commands() {
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			Robot *r = *it;
+			if (r->command != antixtransfer::control_message::SPEED && r->collided)
+				r->stop_command();
+		}
+	}
+
+	/*
+		Whether the team is sensed & controlled this turn. Teams are spread
+		over the turns of their period by their id
+	*/
+	bool
+	team_due(const int team) {
+		map<int, int>::const_iterator it = control_periods.find(team);
+		if (it == control_periods.end() || it->second <= 1)
+			return true;
+		return (antix::turn + team) % it->second == 0;
+	}
+
+	/*
+		Find what pucks each robot can see, without building any messages
+		Used when the controllers are run in the node itself: they read
+		Robot::see_pucks directly
+	*/
+	void
+	update_see_pucks() {
+#if SENSE_NEIGHBOUR_LISTS
+		check_neighbour_lists();
+#endif
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator r = robots.begin(); r != robots_end; r++) {
+			// see_robots is not found here, so these results are not reusable
+			(*r)->sensed_epoch = 0;
+			(*r)->FovBBox( (*r)->sensor_bbox );
+
+			sense_pucks(*r, NULL);
+		}
+#if DEBUG
+		cout << "Sensors re-calculated (no messages)." << endl;
+#endif
+	}
+
+	/*
+		Find what the robot can see, adding it to robot_pb
+
+		With SKIP_IDLE, if the robot has not moved since it was last sensed,
+		what it saw of robots (pucks) is reused when no robot (puck) in the
+		cells it looks at has changed. Pucks rarely move, so robots stopped
+		among moving robots mostly reuse their puck results
+	*/
+	void
+	sense_robot(Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+		// found here rather than on each move so moving touches less
+		r->FovBBox( r->sensor_bbox );
+
+#if SKIP_IDLE
+		bool robots_unchanged,
+			pucks_unchanged;
+		sense_unchanged(r, robots_unchanged, pucks_unchanged);
+
+		if (robots_unchanged)
+			add_seen_robots(r, robot_pb);
+		else
+			sense_robots(r, robot_pb);
+
+		if (pucks_unchanged)
+			add_seen_pucks(r, robot_pb);
+		else
+			sense_pucks(r, robot_pb);
+#else
+		sense_robots(r, robot_pb);
+		sense_pucks(r, robot_pb);
+#endif
+
+		r->sensed_epoch = Robot::sense_epoch;
+		r->sensed_x = r->x;
+		r->sensed_y = r->y;
+		r->sensed_a = r->a;
+	}
+
+	/*
+		Add the robots r last found it could see to robot_pb
+	*/
+	void
+	add_seen_robots(Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+		vector<pair<double, double> >::const_iterator see_robots_end = r->see_robots.end();
+		for (vector<pair<double, double> >::const_iterator it = r->see_robots.begin(); it != see_robots_end; it++) {
+			antixtransfer::sense_data::Robot::Seen_Robot *seen_robot = robot_pb->add_seen_robot();
+			seen_robot->set_range( it->first );
+			seen_robot->set_bearing( it->second );
+		}
+	}
+
+	/*
+		Add the pucks r last found it could see to robot_pb
+	*/
+	void
+	add_seen_pucks(Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+		vector<SeePuck>::const_iterator see_pucks_end = r->see_pucks.end();
+		for (vector<SeePuck>::const_iterator it = r->see_pucks.begin(); it != see_pucks_end; it++) {
+			antixtransfer::sense_data::Robot::Seen_Puck *seen_puck = robot_pb->add_seen_puck();
+			seen_puck->set_range( it->range );
+			seen_puck->set_bearing( it->bearing );
+			seen_puck->set_held( it->puck->held );
+		}
+	}
+
+	/*
+		Find the robots r can see: those in its neighbour list, or else those in
+		the cells its sensor_bbox covers. With SENSE_SYMMETRIC_PAIRS they were
+		already found for all robots by sense_robot_pairs()
+	*/
+	void
+	sense_robots(Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+#if SENSE_SYMMETRIC_PAIRS
+		add_seen_robots(r, robot_pb);
+#elif SENSE_NEIGHBOUR_LISTS
+		r->see_robots.clear();
+		vector<Robot *>::const_iterator near_end = r->near_robots.end();
+		for (vector<Robot *>::const_iterator other = r->near_robots.begin(); other != near_end; other++)
+			TestRobot( r, *other, robot_pb );
+#else
+		r->see_robots.clear();
+		const unsigned int firstx( antix::CellNoWrap_x( r->sensor_bbox.x.min) );
+		const unsigned int lastx( antix::CellNoWrap_x( r->sensor_bbox.x.max) );
+		const int lasty( antix::CellNoWrap_y( r->sensor_bbox.y.max) );
+#if SENSE_CONE_CELLS
+		const ViewCone cone(r);
+#endif
+
+		// a row of the view's cells at a time
+		for (int y = antix::CellNoWrap_y( r->sensor_bbox.y.min); y <= lasty; y++) {
+			const unsigned int row = antix::CellWrap(y) * antix::matrix_height;
+			const unsigned int last = row + lastx;
+#if SENSE_OCCUPANCY
+			for (unsigned int i = Robot::robots_occupied.next(row + firstx, last); i <= last; i = Robot::robots_occupied.next(i + 1, last)) {
+#else
+			for (unsigned int i = row + firstx; i <= last; i++) {
+#endif
+				assert( i < Robot::matrix.size() );
+#if SENSE_CONE_CELLS
+				const int where = cone.classify(i - row, y);
+				if (where != CELL_OUTSIDE)
+					TestRobotsInCell( Robot::matrix[i], r, robot_pb, where == CELL_INSIDE );
+#else
+				TestRobotsInCell( Robot::matrix[i], r, robot_pb );
+#endif
+			}
+		}
+#endif
+	}
+
+	/*
+		As sense_robots(), for pucks. robot_pb may be NULL
+	*/
+	void
+	sense_pucks(Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+		r->see_pucks.clear();
+#if SENSE_NEIGHBOUR_LISTS
+		// pucks picked up since the lists were built are found on robots
+		vector<Puck *>::const_iterator near_end = r->near_pucks.end();
+		for (vector<Puck *>::const_iterator puck = r->near_pucks.begin(); puck != near_end; puck++) {
+			if ( !(*puck)->held )
+				TestPuck( r, *puck, (*puck)->x, (*puck)->y, robot_pb );
+		}
+		if (r->has_puck)
+			TestPuck( r, r->puck, r->x, r->y, robot_pb );
+		vector<Robot *>::const_iterator near_robots_end = r->near_robots.end();
+		for (vector<Robot *>::const_iterator other = r->near_robots.begin(); other != near_robots_end; other++) {
+			if ( (*other)->has_puck )
+				TestPuck( r, (*other)->puck, (*other)->x, (*other)->y, robot_pb );
+		}
+#else
+		const unsigned int firstx( antix::CellNoWrap_x( r->sensor_bbox.x.min) );
+		const unsigned int lastx( antix::CellNoWrap_x( r->sensor_bbox.x.max) );
+		const int lasty( antix::CellNoWrap_y( r->sensor_bbox.y.max) );
+#if SENSE_CONE_CELLS
+		const ViewCone cone(r);
+#endif
+
+		// a row of the view's cells at a time
+		for (int y = antix::CellNoWrap_y( r->sensor_bbox.y.min); y <= lasty; y++) {
+			const unsigned int row = antix::CellWrap(y) * antix::matrix_height;
+			const unsigned int last = row + lastx;
+#if SENSE_OCCUPANCY
+			for (unsigned int i = Robot::pucks_occupied.next(row + firstx, last); i <= last; i = Robot::pucks_occupied.next(i + 1, last)) {
+#else
+			for (unsigned int i = row + firstx; i <= last; i++) {
+#endif
+				assert( i < Robot::matrix.size() );
+#if SENSE_CONE_CELLS
+				const int where = cone.classify(i - row, y);
+				if (where != CELL_OUTSIDE)
+					TestPucksInCell( Robot::matrix[i], r, robot_pb, where == CELL_INSIDE );
+#else
+				TestPucksInCell( Robot::matrix[i], r, robot_pb );
+#endif
+			}
+		}
+#endif
+	}
+
+#if SENSE_SYMMETRIC_PAIRS
+	/*
+		Find what every robot sees of other robots. Robots that may see each
+		other are in the same cell or within reach cells of each other. Each
+		pair is looked at once: pairs in a cell, then pairs between a cell and
+		those near it with a greater index
+	*/
+	void
+	sense_robot_pairs() {
+		// the cell columns our robots are in
+		unsigned int min_x = antix::matrix_height,
+			max_x = 0;
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			(*it)->see_robots.clear();
+			const unsigned int x = (*it)->index % antix::matrix_height;
+			min_x = min(min_x, x);
+			max_x = max(max_x, x);
+		}
+
+		const double cell_size = antix::vision_grid.cell_size;
+		const int reach = ceil(Robot::vision_range / cell_size);
+		vector<unsigned int> neighbours;
+
+		for (unsigned int y = 0; y < antix::matrix_height; y++) {
+			const unsigned int row = y * antix::matrix_height;
+#if SENSE_OCCUPANCY
+			for (unsigned int index = Robot::robots_occupied.next(row + min_x, row + max_x); index <= row + max_x; index = Robot::robots_occupied.next(index + 1, row + max_x)) {
+#else
+			for (unsigned int index = row + min_x; index <= row + max_x; index++) {
+#endif
+				const unsigned int x = index - row;
+				const vector<Robot *> &cell_robots = Robot::matrix[index].robots;
+				if (cell_robots.empty())
+					continue;
+
+				const vector<Robot *>::const_iterator cell_end = cell_robots.end();
+				for (vector<Robot *>::const_iterator a = cell_robots.begin(); a != cell_end; a++)
+					for (vector<Robot *>::const_iterator b = a + 1; b != cell_end; b++)
+						TestRobotPair( *a, *b );
+
+				// cells near it, each once even if y wraps onto itself
+				neighbours.clear();
+				for (int nx = (int) x - reach; nx <= (int) x + reach; nx++) {
+					// x does not wrap
+					if (nx < 0 || nx >= (int) antix::matrix_height)
+						continue;
+					for (int ny = (int) y - reach; ny <= (int) y + reach; ny++) {
+						const unsigned int n = nx + antix::CellWrap(ny) * antix::matrix_height;
+						if (n <= index || Robot::matrix[n].robots.empty() || find(neighbours.begin(), neighbours.end(), n) != neighbours.end())
+							continue;
+						neighbours.push_back(n);
+					}
+				}
+
+				for (unsigned int i = 0; i < neighbours.size(); i++) {
+					const vector<Robot *> &other_robots = Robot::matrix[ neighbours[i] ].robots;
+					const vector<Robot *>::const_iterator other_end = other_robots.end();
+					for (vector<Robot *>::const_iterator a = cell_robots.begin(); a != cell_end; a++)
+						for (vector<Robot *>::const_iterator b = other_robots.begin(); b != other_end; b++)
+							TestRobotPair( *a, *b );
+				}
+			}
+		}
+	}
+
+	/*
+		Whether robots a and b can see each other. Range is found once, the fov
+		check done for each
+	*/
+	inline void
+	TestRobotPair(Robot *a, Robot *b) {
+		const double dx( antix::WrapDistance( b->x - a->x ) );
+		if ( fabs(dx) > Robot::vision_range )
+			return;
+
+		const double dy( antix::WrapDistance( b->y - a->y ) );
+		if ( fabs(dy) > Robot::vision_range )
+			return;
+
+		const double dsq = dx*dx + dy*dy;
+		if ( dsq > Robot::vision_range_squared )
+			return;
+
+		const double range_approx = sqrt(dsq);
+		const double half_fov = Robot::fov/2.0;
+
+		const double a_heading = antix::AngleNormalize( antix::fast_atan2( dy, dx ) - a->a );
+		if ( fabs(a_heading) <= half_fov )
+			a->see_robots.push_back( pair<double, double>(range_approx, a_heading) );
+
+		const double b_heading = antix::AngleNormalize( antix::fast_atan2( -dy, -dx ) - b->a );
+		if ( fabs(b_heading) <= half_fov )
+			b->see_robots.push_back( pair<double, double>(range_approx, b_heading) );
+	}
+#endif
+
+#if SENSE_NEIGHBOUR_LISTS
+	/*
+		Rebuild the neighbour lists if robots / pucks were added or removed, or
+		one has moved more than half the skin since they were built. Until then
+		no pair can have come within vision_range that was not within
+		vision_range + skin
+	*/
+	void
+	check_neighbour_lists() {
+		if (!neighbour_lists_stale) {
+			const double half_skin = SENSE_SKIN * Robot::vision_range / 2.0;
+			const double limit_squared = half_skin * half_skin;
+
+			vector<Robot *>::const_iterator robots_end = robots.end();
+			for (vector<Robot *>::const_iterator r = robots.begin(); r != robots_end && !neighbour_lists_stale; r++) {
+				const double dx( antix::WrapDistance( (*r)->x - (*r)->listed_x ) );
+				const double dy( antix::WrapDistance( (*r)->y - (*r)->listed_y ) );
+				if (dx*dx + dy*dy > limit_squared)
+					neighbour_lists_stale = true;
+			}
+
+			// pucks jump when dropped or respawned. One dropped that was held
+			// when the lists were built is in none
+			vector<Puck *>::const_iterator pucks_end = pucks.end();
+			for (vector<Puck *>::const_iterator p = pucks.begin(); p != pucks_end && !neighbour_lists_stale; p++) {
+				if ( (*p)->listed_held && !(*p)->held ) {
+					neighbour_lists_stale = true;
+					break;
+				}
+				const double dx( antix::WrapDistance( (*p)->x - (*p)->listed_x ) );
+				const double dy( antix::WrapDistance( (*p)->y - (*p)->listed_y ) );
+				if (dx*dx + dy*dy > limit_squared)
+					neighbour_lists_stale = true;
+			}
+		}
+
+		if (neighbour_lists_stale)
+			build_neighbour_lists();
+	}
+
+	/*
+		For each robot, find the robots & pucks within vision_range + skin
+	*/
+	void
+	build_neighbour_lists() {
+		const double reach = Robot::vision_range * (1 + SENSE_SKIN);
+		const double reach_squared = reach * reach;
+		const GridGeometry &grid = antix::vision_grid;
+
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			Robot *r = *it;
+			r->near_robots.clear();
+			r->near_pucks.clear();
+			r->listed_x = r->x;
+			r->listed_y = r->y;
+
+			// x does not wrap in the matrix, y does
+			const int firstx = grid.cell( max(0.0, r->x - reach) );
+			const int lastx = min( grid.cell(r->x + reach), (int) antix::matrix_height - 1 );
+			const int firsty = grid.cell(r->y - reach);
+			const int lasty = min( grid.cell(r->y + reach), firsty + (int) antix::matrix_height - 1 );
+
+			for (int x = firstx; x <= lastx; x++) {
+				for (int y = firsty; y <= lasty; y++) {
+					const MatrixCell &cell = SensorsCell(x, y);
+
+					vector<Robot *>::const_iterator cell_robots_end = cell.robots.end();
+					for (vector<Robot *>::const_iterator other = cell.robots.begin(); other != cell_robots_end; other++) {
+						if (r == *other)
+							continue;
+						const double dx( antix::WrapDistance( (*other)->x - r->x ) );
+						const double dy( antix::WrapDistance( (*other)->y - r->y ) );
+						if (dx*dx + dy*dy <= reach_squared)
+							r->near_robots.push_back( *other );
+					}
+
+					vector<Puck *>::const_iterator cell_pucks_end = cell.pucks.end();
+					for (vector<Puck *>::const_iterator puck = cell.pucks.begin(); puck != cell_pucks_end; puck++) {
+						const double dx( antix::WrapDistance( (*puck)->x - r->x ) );
+						const double dy( antix::WrapDistance( (*puck)->y - r->y ) );
+						if (dx*dx + dy*dy <= reach_squared)
+							r->near_pucks.push_back( *puck );
+					}
+				}
+			}
+		}
+
+		vector<Puck *>::const_iterator pucks_end = pucks.end();
+		for (vector<Puck *>::const_iterator p = pucks.begin(); p != pucks_end; p++) {
+			(*p)->listed_x = (*p)->x;
+			(*p)->listed_y = (*p)->y;
+			(*p)->listed_held = (*p)->held;
+		}
+
+		neighbour_lists_stale = false;
+		neighbour_list_builds++;
+	}
+#endif
+
+#if SKIP_IDLE
+	/*
+		Whether what the robot saw of robots / pucks when last sensed is still
+		what it sees: it has the same pose, and no robot / puck in a cell it
+		looks at has changed since
+	*/
+	void
+	sense_unchanged(Robot *r, bool &robots_unchanged, bool &pucks_unchanged) {
+		const int lastx( antix::CellNoWrap_x( r->sensor_bbox.x.max) );
+		const int lasty( antix::CellNoWrap_y( r->sensor_bbox.y.max) );
+
+		robots_unchanged = pucks_unchanged = r->sensed_epoch != 0
+			&& r->x == r->sensed_x && r->y == r->sensed_y && r->a == r->sensed_a;
+
+		for (int x = antix::CellNoWrap_x( r->sensor_bbox.x.min); x <= lastx && (robots_unchanged || pucks_unchanged); x++) {
+			for (int y = antix::CellNoWrap_y( r->sensor_bbox.y.min); y <= lasty; y++) {
+				const MatrixCell &cell = SensorsCell(x, y);
+				if (cell.robots_stamp >= r->sensed_epoch)
+					robots_unchanged = false;
+				if (cell.pucks_stamp >= r->sensed_epoch)
+					pucks_unchanged = false;
+			}
+		}
+	}
+#endif
+
+	/*
+		Set those fields of the robot's pose in robot_pb that have changed since
+		we last sent them (or all on a keyframe / robot new to us)
+	*/
+	void
+	add_pose_delta(Robot *r, antixtransfer::sense_data::Robot *robot_pb, const bool keyframe) {
+		SenseSent *sent = &r->sent;
+		const bool all = keyframe || !sent->valid;
+
+		if (all || sent->x != r->x) {
+			robot_pb->set_x( r->x );
+			sent->x = r->x;
+		}
+		if (all || sent->y != r->y) {
+			robot_pb->set_y( r->y );
+			sent->y = r->y;
+		}
+		if (all || sent->a != r->a) {
+			robot_pb->set_a( r->a );
+			sent->a = r->a;
+		}
+		if (all || sent->has_puck != r->has_puck) {
+			robot_pb->set_has_puck( r->has_puck );
+			sent->has_puck = r->has_puck;
+		}
+		if (all || sent->collided != r->collided) {
+			robot_pb->set_collided( r->collided );
+			sent->collided = r->collided;
+		}
+#if !CLIENT_MEMORY
+		if (all || sent->last_x != r->last_x) {
+			robot_pb->set_last_x( r->last_x );
+			sent->last_x = r->last_x;
+		}
+		if (all || sent->last_y != r->last_y) {
+			robot_pb->set_last_y( r->last_y );
+			sent->last_y = r->last_y;
+		}
+#endif
+	}
+
+	/*
+		robot_pb holds what the robot sees this turn. Each seen list is sent
+		against the one we last sent: with its length, and only the entries
+		that differ from the previous list at the same position, along with
+		their positions. An entry is so unchanged (left out), changed or added
+		past the previous list's end (sent), or removed by the list being
+		shorter. Keyframes and robots new to us get full lists
+
+		Must be called after add_pose_delta(): this marks the sent state valid
+	*/
+	void
+	seen_delta(Robot *r, antixtransfer::sense_data::Robot *robot_pb, const bool keyframe) {
+		SenseSent *sent = &r->sent;
+		const bool all = keyframe || !sent->valid;
+		sent->valid = true;
+
+		// robots. Changed entries are moved down over those left out
+		const int seen_robot_size = robot_pb->seen_robot_size();
+		const int prev_robot_size = sent->seen_robots.size();
+		sent->seen_robots.resize(seen_robot_size);
+		int changed = 0;
+		for (int i = 0; i < seen_robot_size; i++) {
+			const double range = robot_pb->seen_robot(i).range();
+			const double bearing = robot_pb->seen_robot(i).bearing();
+			if (!all && i < prev_robot_size && sent->seen_robots[i].first == range
+				&& sent->seen_robots[i].second == bearing)
+				continue;
+
+			sent->seen_robots[i] = pair<double, double>(range, bearing);
+			if (!all) {
+				antixtransfer::sense_data::Robot::Seen_Robot *seen = robot_pb->mutable_seen_robot(changed);
+				seen->set_range(range);
+				seen->set_bearing(bearing);
+				robot_pb->add_seen_robot_index(i);
+			}
+			changed++;
+		}
+		if (!all) {
+			robot_pb->set_seen_robot_count(seen_robot_size);
+			while (robot_pb->seen_robot_size() > changed)
+				robot_pb->mutable_seen_robot()->RemoveLast();
+		}
+
+		// pucks
+		const int seen_puck_size = robot_pb->seen_puck_size();
+		const int prev_puck_size = sent->seen_pucks.size();
+		sent->seen_pucks.resize(seen_puck_size, CSeePuck(false, 0, 0));
+		changed = 0;
+		for (int i = 0; i < seen_puck_size; i++) {
+			const bool held = robot_pb->seen_puck(i).held();
+			const double range = robot_pb->seen_puck(i).range();
+			const double bearing = robot_pb->seen_puck(i).bearing();
+			if (!all && i < prev_puck_size && sent->seen_pucks[i].range == range
+				&& sent->seen_pucks[i].bearing == bearing && sent->seen_pucks[i].held == held)
+				continue;
+
+			sent->seen_pucks[i] = CSeePuck(held, range, bearing);
+			if (!all) {
+				antixtransfer::sense_data::Robot::Seen_Puck *seen = robot_pb->mutable_seen_puck(changed);
+				seen->set_held(held);
+				seen->set_range(range);
+				seen->set_bearing(bearing);
+				robot_pb->add_seen_puck_index(i);
+			}
+			changed++;
+		}
+		if (!all) {
+			robot_pb->set_seen_puck_count(seen_puck_size);
+			while (robot_pb->seen_puck_size() > changed)
+				robot_pb->mutable_seen_puck()->RemoveLast();
+		}
+	}
+
 	/*
 		- Look at each home that has area within our section of the map
 		- Go through the pucks in that home
@@ -673,7 +1597,7 @@ public:
 #if DEBUG_ERASE_PUCK
 		cout << "EraseAll puck #1 in update_scores()" << endl;
 #endif
-					antix::EraseAll( *it2, Robot::matrix[ (*it2)->index ].pucks );
+					Robot::cell_remove_puck( (*it2)->index, *it2 );
 
 					// respawn puck
 					respawn_puck( *it2 );
@@ -720,30 +1644,31 @@ public:
 		const int cindex = antix::CCell( r->x, r->y );
 
 #ifndef NDEBUG
+		Robot *occupant = Robot::cell_occupant(cindex);
 		// If the cell is occupied, see if that robot is listed in a critical section
 		// This means that we told the other node about it (hopefully)
-		if (Robot::cmatrix[cindex] != NULL) {
+		if (occupant != NULL) {
 			bool found = false;
 			for (vector<Robot *>::iterator it = left_crit.begin(); it != left_crit.end(); it++) {
-				if (*it == Robot::cmatrix[cindex]) {
+				if (*it == occupant) {
 					found = true;
 					break;
 				}
 			}
 			for (vector<Robot *>::iterator it = left_crit_new.begin(); it != left_crit_new.end(); it++) {
-				if (*it == Robot::cmatrix[cindex]) {
+				if (*it == occupant) {
 					found = true;
 					break;
 				}
 			}
 			for (vector<Robot *>::iterator it = right_crit.begin(); it != right_crit.end(); it++) {
-				if (*it == Robot::cmatrix[cindex]) {
+				if (*it == occupant) {
 					found = true;
 					break;
 				}
 			}
 			for (vector<Robot *>::iterator it = right_crit_new.begin(); it != right_crit_new.end(); it++) {
-				if (*it == Robot::cmatrix[cindex]) {
+				if (*it == occupant) {
 					found = true;
 					break;
 				}
@@ -752,7 +1677,7 @@ public:
 		}
 #endif
 
-		assert( Robot::cmatrix[cindex] == NULL );
+		assert( Robot::cell_occupant(cindex) == NULL );
 
 #ifndef NDEBUG
 		Robot *collided = Robot::did_collide(r, cindex, r->x, r->y);
@@ -764,7 +1689,7 @@ public:
 #endif
 
 		r->cindex = cindex;
-		Robot::cmatrix[cindex] = r;
+		Robot::cmatrix_add(r);
 
 		return r;
 	}
@@ -861,38 +1786,74 @@ public:
 	*/
 	void
 	update_left_crit_region(antixtransfer::SendMap *crit_map, antixtransfer::move_bot *move_msg, antixtransfer::SendMap *crit_map_ours) {
+		// Right now we only track foreign robots for collisions
+		add_left_ghosts(crit_map);
 
-		move_msg->clear_robot();
-		crit_map_ours->clear_robot();
+		// Update poses of the robots in our left critical region
+		move_left_crit(NULL, 0);
 
-		// Right now we only track foreign robots for collisions
+		finish_left_crit_region(move_msg, crit_map_ours);
+	}
 
-		// Indices into cmatrix to remove when movement is complete
-		vector<Robot *> temp_foreign_robots;
+	/*
+		Add the robots in the left neighbour's right critical section to our
+		cmatrix for our left critical section robots to collide with
+	*/
+	void
+	add_left_ghosts(antixtransfer::SendMap *crit_map) {
 		const int robot_size = crit_map->robot_size();
 		for (int i = 0; i < robot_size; i++) {
 			//cout << "Add foreign crit in update_left_crit_region()" << endl;
 			Robot *r = add_foreign_crit_robot(crit_map->robot(i).x(), crit_map->robot(i).y() );
 			// track for later deletion
-			temp_foreign_robots.push_back(r);
+			left_ghosts.push_back(r);
 		}
+	}
 
-		// Update poses of the robots in our left critical region
-		// We also check if the robots move to another node or outside of critical
-		// region
-
-		// while loop since we may remove robots
-		vector<Robot *>::iterator it = left_crit.begin();
-		while ( it != left_crit.end() ) {
+	/*
+		Remove the robots added by add_left_ghosts()
+	*/
+	void
+	remove_left_ghosts() {
+		vector<Robot *>::const_iterator left_ghosts_end = left_ghosts.end();
+		for (vector<Robot *>::const_iterator it = left_ghosts.begin(); it != left_ghosts_end; it++) {
 			Robot *r = *it;
+			Robot::cmatrix_remove(r);
+			delete r;
+		}
+		left_ghosts.clear();
+	}
+
+	/*
+		Update poses of the robots in our left critical region, from the
+		robot at index first on
+		If journal is given, record each robot's state before it moves
+	*/
+	void
+	move_left_crit(vector<PoseCheckpoint> *journal, const unsigned int first) {
+		const unsigned int left_crit_size = left_crit.size();
+		for (unsigned int i = first; i < left_crit_size; i++) {
+			Robot *r = left_crit[i];
+			if (journal != NULL)
+				journal->push_back( PoseCheckpoint(r) );
 			r->update_pose();
-			it++;
 		}
+	}
+
+	/*
+		Once our left critical region robots have moved:
+		- check if they moved to another node or out of the critical region
+		- remove the foreign robots
+		- build move message & list of our left critical region robots
+	*/
+	void
+	finish_left_crit_region(antixtransfer::move_bot *move_msg, antixtransfer::SendMap *crit_map_ours) {
 
-		// Then check if they moved to another node or left crit region
+		move_msg->clear_robot();
+		crit_map_ours->clear_robot();
 
 		// while loop since we may remove robots
-		it = left_crit.begin();
+		vector<Robot *>::iterator it = left_crit.begin();
 		while ( it != left_crit.end() ) {
 			Robot *r = *it;
 
@@ -928,14 +1889,7 @@ public:
 		}
 
 		// Remove all the foreign critical section robots
-		vector<Robot *>::const_iterator temp_foreign_robots_end = temp_foreign_robots.end();
-		for (vector<Robot *>::const_iterator it = temp_foreign_robots.begin(); it != temp_foreign_robots_end; it++) {
-			Robot *r = *it;
-			assert( Robot::cmatrix[ r->cindex ] == r );
-			Robot::cmatrix[ r->cindex ] = NULL;
-			delete r;
-		}
-		temp_foreign_robots.clear();
+		remove_left_ghosts();
 
 		// Add all robots in our left critical section to crit_map_ours
 		// XXX optimize
@@ -955,6 +1909,142 @@ public:
 		}
 	}
 
+#if SPECULATIVE_BORDER
+	/*
+		Our left neighbour has sent the robots in its right critical section
+		after its turn. Until it moves them again, this is what it will send at
+		the start of our next turn, apart from robots that newly enter its
+		critical section
+	*/
+	void
+	record_left_ghosts(antixtransfer::SendMap *crit_map) {
+		spec_left_ghosts.clear();
+		const int robot_size = crit_map->robot_size();
+		for (int i = 0; i < robot_size; i++)
+			spec_left_ghosts.push_back( pair<double, double>(crit_map->robot(i).x(), crit_map->robot(i).y()) );
+	}
+
+	/*
+		Update our left critical region robots as if the left neighbour will
+		send spec_left_ghosts, recording each update so it can be undone
+		Messages are built once the real list arrives: resolve_left_crit_region()
+	*/
+	void
+	speculate_left_crit_region() {
+		spec_journal.clear();
+		vector<pair<double, double> >::const_iterator ghosts_end = spec_left_ghosts.end();
+		for (vector<pair<double, double> >::const_iterator it = spec_left_ghosts.begin(); it != ghosts_end; it++)
+			left_ghosts.push_back( add_foreign_crit_robot(it->first, it->second) );
+
+		move_left_crit(&spec_journal, 0);
+	}
+
+	/*
+		Whether any of the given ghosts could have changed the update recorded
+		in cp: the ghost is near enough to where the robot was moving to to be
+		in a cell update_pose() checks
+	*/
+	bool
+	ghosts_affect(const PoseCheckpoint &cp, const vector<pair<double, double> > &ghosts) {
+		const double reach = fabs(cp.v) + 4 * Robot::robot_radius;
+		vector<pair<double, double> >::const_iterator ghosts_end = ghosts.end();
+		for (vector<pair<double, double> >::const_iterator it = ghosts.begin(); it != ghosts_end; it++) {
+			if ( fabs( antix::WrapDistance(it->first - cp.x) ) <= reach &&
+				fabs( antix::WrapDistance(it->second - cp.y) ) <= reach )
+				return true;
+		}
+		return false;
+	}
+
+	/*
+		Put a robot back as it was before the update recorded in cp
+	*/
+	void
+	undo_pose(const PoseCheckpoint &cp) {
+		Robot *r = cp.r;
+
+		if (cp.other != NULL) {
+			cp.other->a = cp.other_a;
+			cp.other->v = cp.other_v;
+			cp.other->w = cp.other_w;
+			cp.other->collided = cp.other_collided;
+		}
+
+#if COLLISIONS
+		if (r->cindex != cp.cindex)
+			Robot::cmatrix_move(r, cp.cindex);
+#endif
+
+		// NOTE: this may reorder the cell lists, and so the order of seen lists
+		if (r->index != cp.index) {
+			Robot::cell_remove_robot( r->index, r );
+			Robot::cell_add_robot( cp.index, r );
+		} else {
+			Robot::cell_touch_robots( r->index );
+			if (r->has_puck)
+				Robot::cell_touch_pucks( r->index );
+		}
+
+		r->x = cp.x;
+		r->y = cp.y;
+		r->a = cp.a;
+		r->v = cp.v;
+		r->w = cp.w;
+		r->collided = cp.collided;
+		r->index = cp.index;
+		r->cindex = cp.cindex;
+		r->sensor_bbox = cp.sensor_bbox;
+	}
+
+	/*
+		The left neighbour's real list of robots in its right critical section
+		has arrived. Where it differs from our guess, undo the updates from the
+		first robot that could have been affected on, and redo them with the
+		real robots. Then finish as update_left_crit_region() does
+	*/
+	void
+	resolve_left_crit_region(antixtransfer::SendMap *crit_map, antixtransfer::move_bot *move_msg, antixtransfer::SendMap *crit_map_ours) {
+		vector<pair<double, double> > real;
+		const int robot_size = crit_map->robot_size();
+		for (int i = 0; i < robot_size; i++)
+			real.push_back( pair<double, double>(crit_map->robot(i).x(), crit_map->robot(i).y()) );
+
+		// ghosts in only one of the lists
+		vector<pair<double, double> > guessed(spec_left_ghosts);
+		sort(real.begin(), real.end());
+		sort(guessed.begin(), guessed.end());
+		vector<pair<double, double> > wrong;
+		set_symmetric_difference(real.begin(), real.end(), guessed.begin(), guessed.end(), back_inserter(wrong));
+
+		unsigned int first = spec_journal.size();
+		if (!wrong.empty()) {
+			for (unsigned int i = 0; i < spec_journal.size(); i++) {
+				if (ghosts_affect(spec_journal[i], wrong)) {
+					first = i;
+					break;
+				}
+			}
+		}
+
+		if (first < spec_journal.size()) {
+			spec_misses++;
+			spec_redone += spec_journal.size() - first;
+
+			for (int i = spec_journal.size() - 1; i >= (int) first; i--)
+				undo_pose(spec_journal[i]);
+
+			remove_left_ghosts();
+			add_left_ghosts(crit_map);
+			move_left_crit(NULL, first);
+		} else {
+			spec_hits++;
+		}
+		spec_journal.clear();
+
+		finish_left_crit_region(move_msg, crit_map_ours);
+	}
+#endif
+
 	/*
 		Take the final positions of the foreign robots in the crit section for this turn
 	*/
@@ -967,6 +2057,42 @@ public:
 		}
 	}
 
+#if BATCH_POSES
+	/*
+		Gather the robots update_poses() will move, in the order it moves
+		them, and propose all their poses at once
+	*/
+	void
+	propose_poses() {
+		batch_x.clear();
+		batch_y.clear();
+		batch_a.clear();
+		batch_v.clear();
+		batch_w.clear();
+
+		vector<Robot *>::const_iterator robots_end = robots.end();
+		for (vector<Robot *>::const_iterator it = robots.begin(); it != robots_end; it++) {
+			const Robot *r = *it;
+			if (r->critical_section != NULL)
+				continue;
+			batch_x.push_back( r->x );
+			batch_y.push_back( r->y );
+			batch_a.push_back( r->a );
+			batch_v.push_back( r->v );
+			batch_w.push_back( r->w );
+		}
+
+		const unsigned int n = batch_x.size();
+		proposed_x.resize(n);
+		proposed_y.resize(n);
+		proposed_a.resize(n);
+		if (n == 0)
+			return;
+		antix::propose_poses(n, &batch_x[0], &batch_y[0], &batch_a[0], &batch_v[0], &batch_w[0],
+			&proposed_x[0], &proposed_y[0], &proposed_a[0]);
+	}
+#endif
+
 	/*
 		Go through our local robots & update their poses
 	*/
@@ -997,6 +2123,10 @@ public:
 
 		// Now move all robots that we can
 		vector<Robot *>::const_iterator robots_end = robots.end();
+#if BATCH_POSES
+		propose_poses();
+		unsigned int batch_index = 0;
+#endif
 #ifndef NDEBUG
 		int robot_count = 0;
 #endif
@@ -1005,7 +2135,16 @@ public:
 			r = *it;
 			// Only update pose for those not in a critical region
 			if (r->critical_section == NULL) {
+#if BATCH_POSES
+				const unsigned int i = batch_index++;
+				// a robot we collided with this turn turned around: propose again
+				if (r->a == batch_a[i] && r->v == batch_v[i] && r->w == batch_w[i])
+					r->update_pose( proposed_x[i], proposed_y[i], proposed_a[i] );
+				else
+					r->update_pose();
+#else
 				r->update_pose();
+#endif
 
 				// Check if the robot moved into a critical section
 				// XXX These checks assume a robot cannot move out of node without first
@@ -1079,8 +2218,7 @@ public:
 		for (vector<Robot *>::iterator it = foreign_critical_robots.begin(); it != foreign_critical_robots.end(); it++) {
 			Robot *r = *it;
 
-			assert( Robot::cmatrix[ r->cindex ] == r );
-			Robot::cmatrix[ r->cindex ] = NULL;
+			Robot::cmatrix_remove(r);
 			delete r;
 		}
 		foreign_critical_robots.clear();
@@ -1129,8 +2267,10 @@ public:
 			pucks_count++;
 #endif
 			antixtransfer::SendMap_GUI::Puck *puck = gui_map->add_puck();
-			puck->set_x( (*it)->x );
-			puck->set_y( (*it)->y );
+			// held pucks are where their robot is
+			const Puck *p = *it;
+			puck->set_x( p->held ? p->robot->x : p->x );
+			puck->set_y( p->held ? p->robot->y : p->y );
 			puck->set_held( (*it)->held );
 		}
 		assert(pucks_count == pucks.size());
@@ -1154,30 +2294,17 @@ public:
 	}
 
 	/*
-		from rtv's Antix
+		The sense matrix cell at x, y (y wraps)
 	*/
-	inline void
-	UpdateSensorsCell(unsigned int x, unsigned int y, Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
-		//unsigned int index( antix::CellWrap(x) + ( antix::CellWrap(y) * antix::matrix_width ) );
-		//if (x < 0 || x > antix::matrix_width || y < 0 || y > antix::matrix_height)
-
-		// we don't wrap along x, so don't care about these cases
-		// XXX something like this may make sense
-		// x < our min coord, x > our max coord
-		//if (x < 0 || x > antix::matrix_width)
-		//	return;
-
-		// We don't wrap x, just y (since map split along x axis)
+	inline MatrixCell &
+	SensorsCell(unsigned int x, unsigned int y) {
 		unsigned int index( x + (antix::CellWrap(y) * antix::matrix_height) );
-		//cout << "Index in updatesensors cell " << index << " x " << x << " y " << antix::CellWrap(y) << endl;
 		assert( index < Robot::matrix.size());
-
-		TestRobotsInCell( Robot::matrix[index], r, robot_pb );
-		TestPucksInCell( Robot::matrix[index], r, robot_pb );
+		return Robot::matrix[index];
 	}
 
 	void
-	TestRobotsInCell(const MatrixCell& cell, Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+	TestRobotsInCell(const MatrixCell& cell, Robot *r, antixtransfer::sense_data::Robot *robot_pb, const bool in_view = false) {
 		// look at robots in this cell and see if we can see them
 		vector<Robot *>::const_iterator robots_end = cell.robots.end();
 #ifndef NDEBUG
@@ -1190,38 +2317,50 @@ public:
 			// we don't look at ourself
 			if (r == *other)
 				continue;
-			
-			const double dx( antix::WrapDistance( (*other)->x - r->x ) );
-			if ( fabs(dx) > Robot::vision_range )
-				continue;
 
-			const double dy( antix::WrapDistance( (*other)->y - r->y ) );
-			if ( fabs(dy) > Robot::vision_range )
-				continue;
+			TestRobot( r, *other, robot_pb, in_view );
+		}
+		assert(robots_count == cell.robots.size());
+	}
 
-			//double range = hypot( dx, dy );
-			//if (range > Robot::vision_range )
-			const double dsq = dx*dx + dy*dy;
-			if ( dsq > Robot::vision_range_squared )
-				continue;
+	/*
+		from rtv's Antix
+		in_view: other is known to be within range & fov
+	*/
+	inline void
+	TestRobot(Robot *r, Robot *other, antixtransfer::sense_data::Robot *robot_pb, const bool in_view = false) {
+		const double dx( antix::WrapDistance( other->x - r->x ) );
+		if ( !in_view && fabs(dx) > Robot::vision_range )
+			return;
 
-			// check that it's in fov
-			const double absolute_heading = antix::fast_atan2( dy, dx );
-			const double relative_heading = antix::AngleNormalize(absolute_heading - r->a);
-			if ( fabs(relative_heading) > Robot::fov/2.0 )
-				continue;
+		const double dy( antix::WrapDistance( other->y - r->y ) );
+		if ( !in_view && fabs(dy) > Robot::vision_range )
+			return;
 
-			// we can see the robot
-			antixtransfer::sense_data::Robot::Seen_Robot *seen_robot = robot_pb->add_seen_robot();
-			//seen_robot->set_range( range );
-			seen_robot->set_range( sqrt(dsq) );
-			seen_robot->set_bearing( relative_heading );
-		}
-		assert(robots_count == cell.robots.size());
+		//double range = hypot( dx, dy );
+		//if (range > Robot::vision_range )
+		const double dsq = dx*dx + dy*dy;
+		if ( !in_view && dsq > Robot::vision_range_squared )
+			return;
+
+		// check that it's in fov
+		const double absolute_heading = antix::fast_atan2( dy, dx );
+		const double relative_heading = antix::AngleNormalize(absolute_heading - r->a);
+		if ( !in_view && fabs(relative_heading) > Robot::fov/2.0 )
+			return;
+
+		// we can see the robot
+		antixtransfer::sense_data::Robot::Seen_Robot *seen_robot = robot_pb->add_seen_robot();
+		//seen_robot->set_range( range );
+		const double range_approx = sqrt(dsq);
+		seen_robot->set_range( range_approx );
+		seen_robot->set_bearing( relative_heading );
+
+		r->see_robots.push_back( pair<double, double>(range_approx, relative_heading) );
 	}
 
 	void
-	TestPucksInCell(const MatrixCell& cell, Robot *r, antixtransfer::sense_data::Robot *robot_pb) {
+	TestPucksInCell(const MatrixCell& cell, Robot *r, antixtransfer::sense_data::Robot *robot_pb, const bool in_view = false) {
 		// check which pucks in this cell we can see
 		vector<Puck *>::const_iterator pucks_end = cell.pucks.end();
 #ifndef NDEBUG
@@ -1231,50 +2370,72 @@ public:
 #ifndef NDEBUG
 			pucks_count++;
 #endif
-			const double dx( antix::WrapDistance( (*puck)->x - r->x ) );
-			if ( fabs(dx) > Robot::vision_range )
-				continue;
+			TestPuck( r, *puck, (*puck)->x, (*puck)->y, robot_pb, in_view );
+		}
+		assert(pucks_count == cell.pucks.size());
 
-			const double dy( antix::WrapDistance( (*puck)->y - r->y ) );
-			if ( fabs(dy) > Robot::vision_range )
-				continue;
+		// and those carried by robots in the cell
+		if (cell.held_pucks == 0)
+			return;
+		vector<Robot *>::const_iterator robots_end = cell.robots.end();
+		for (vector<Robot *>::const_iterator other = cell.robots.begin(); other != robots_end; other++) {
+			if ( (*other)->has_puck )
+				TestPuck( r, (*other)->puck, (*other)->x, (*other)->y, robot_pb, in_view );
+		}
+	}
 
-			//double range = hypot( dx, dy );
-			//if (range > Robot::vision_range)
-			const double dsq = dx*dx + dy*dy;
-			if ( dsq > Robot::vision_range_squared )
-				continue;
+	/*
+		from rtv's Antix
+		x, y: where the puck is, which for a held puck is where its robot is
+		in_view: puck is known to be within range & fov
+	*/
+	inline void
+	TestPuck(Robot *r, Puck *puck, const double x, const double y, antixtransfer::sense_data::Robot *robot_pb, const bool in_view = false) {
+		const double dx( antix::WrapDistance( x - r->x ) );
+		if ( !in_view && fabs(dx) > Robot::vision_range )
+			return;
 
-			// fov check
-			const double absolute_heading = antix::fast_atan2( dy, dx );
-			const double relative_heading = antix::AngleNormalize( absolute_heading - r->a );
-			if ( fabs(relative_heading) > Robot::fov/2.0 )
-				continue;
+		const double dy( antix::WrapDistance( y - r->y ) );
+		if ( !in_view && fabs(dy) > Robot::vision_range )
+			return;
+
+		//double range = hypot( dx, dy );
+		//if (range > Robot::vision_range)
+		const double dsq = dx*dx + dy*dy;
+		if ( !in_view && dsq > Robot::vision_range_squared )
+			return;
 
-			// we can see the puck
+		// fov check
+		const double absolute_heading = antix::fast_atan2( dy, dx );
+		const double relative_heading = antix::AngleNormalize( absolute_heading - r->a );
+		if ( !in_view && fabs(relative_heading) > Robot::fov/2.0 )
+			return;
+
+		// we can see the puck
+		const double range_approx = sqrt(dsq);
+		// no message when controllers run in the node
+		if (robot_pb != NULL) {
 			antixtransfer::sense_data::Robot::Seen_Puck *seen_puck = robot_pb->add_seen_puck();
-			const double range_approx = sqrt(dsq);
 			//seen_puck->set_range( range );
 			seen_puck->set_range( range_approx );
 			seen_puck->set_bearing ( relative_heading );
-			seen_puck->set_held( (*puck)->held );
+			seen_puck->set_held( puck->held );
+		}
 
-			//r->see_pucks.push_back(SeePuck(*puck, range));
-			r->see_pucks.push_back(SeePuck(*puck, range_approx));
+		//r->see_pucks.push_back(SeePuck(puck, range));
+		r->see_pucks.push_back(SeePuck(puck, range_approx, relative_heading));
 
-			// make sure this puck is in vector as well
+		// make sure this puck is in vector as well
 #ifndef NDEBUG
-			bool found = false;
-			for (vector<Puck *>::iterator it2 = pucks.begin(); it2 != pucks.end(); it2++) {
-				if ( (*it2) == *puck ) {
-					found = true;
-					break;
-				}
+		bool found = false;
+		for (vector<Puck *>::iterator it2 = pucks.begin(); it2 != pucks.end(); it2++) {
+			if ( (*it2) == puck ) {
+				found = true;
+				break;
 			}
-			assert(found == true);
-#endif
 		}
-		assert(pucks_count == cell.pucks.size());
+		assert(found == true);
+#endif
 	}
 };
 #endif
@@ -31,6 +31,8 @@ const double home_radius = 0.1;
 // radius of robot
 const double robot_radius = 0.01;
 const double pickup_range = vision_range / 5.0;
+// vision matrix cells per vision range given to nodes. 0: nodes choose
+double vision_cells_per_range = 1;
 
 bool shutting_down = false;
 // track whether simulation has begun
@@ -58,6 +60,13 @@ antixtransfer::done done_msg;
 
 // used for synchronous turns
 set<int> nodes_done;
+#if TREE_BARRIER
+int nodes_done_count = 0;
+#endif
+#if NEIGHBOUR_SYNC
+// highest turn any node has told us it is on
+int max_node_turn = 0;
+#endif
 
 // global scores - not updated every turn, but in general
 map<int, int> scores;
@@ -366,6 +375,7 @@ handle_node_init(zmq::socket_t *nodes_socket) {
 	init_response.set_robot_radius(robot_radius);
 	init_response.set_fov(fov);
 	init_response.set_pickup_range(pickup_range);
+	init_response.set_vision_cells_per_range(vision_cells_per_range);
 	antix::send_pb(nodes_socket, &init_response);
 
 	// add node to internal listing of nodes
@@ -451,6 +461,10 @@ handle_done(zmq::socket_t *rep_sock,
 	if (done_msg.type() == antixtransfer::done::NODE) {
 		// Record node if we haven't heard from it before
 		nodes_done->insert(done_msg.my_id());
+#if TREE_BARRIER
+		// node 0 is done for all nodes below it in the tree
+		nodes_done_count += done_msg.nodes();
+#endif
 
 		// Update global scores (though they are not sent every turn)
 		int scores_size = done_msg.scores_size();
@@ -470,9 +484,26 @@ handle_done(zmq::socket_t *rep_sock,
 		cerr << "Error: Bad type in done message." << endl;
 		exit(-1);
 	}
+
+#if NEIGHBOUR_SYNC
+	// Nodes are not waiting on us: only record how far along they are
+	if (done_msg.turn() > max_node_turn) {
+		max_node_turn = done_msg.turn();
+		const double seconds = time(NULL) - start_time;
+		if (seconds != 0)
+			cout << max_node_turn / seconds << " turns/second (" << max_node_turn << " turns)" << endl;
+	}
+	nodes_done->clear();
+	return;
+#endif
 	
 	// If we've heard from all nodes, start next turn
+#if TREE_BARRIER
+	if (nodes_done_count == node_list.node_size()) {
+		nodes_done_count = 0;
+#else
 	if (nodes_done->size() == node_list.node_size()) {
+#endif
 		// Output scores to stdout
 		if (antix::turn % TURNS_SEND_SCORE == 0) {
 			for (map<int, int>::const_iterator it = scores.begin(); it != scores.end(); it++) {
@@ -505,6 +536,22 @@ handle_done(zmq::socket_t *rep_sock,
 	}
 }
 
+#if NEIGHBOUR_SYNC
+/*
+	Tell nodes the earliest turn to stop after. Neighbouring nodes must stop
+	on the same turn, or one would wait forever on the other's handshake.
+	Nodes may be past this turn by the time they hear of it, so they settle
+	on the actual turn among themselves through the border handshake
+*/
+void
+send_stop_turn(zmq::socket_t *publish_sock) {
+	antixtransfer::stop stop_msg;
+	stop_msg.set_turn( max_node_turn + 2 * TURNS_SEND_SCORE );
+	cout << "Sending shutdown message to nodes: stop after turn " << stop_msg.turn() << endl;
+	antix::send_pb_envelope(publish_sock, &stop_msg, "s");
+}
+#endif
+
 /*
 	GUI sends a req. Send back a list of scores for each home
 */
@@ -534,14 +581,16 @@ main(int argc, char **argv) {
 	srand( time(NULL) );
 	srand48( time(NULL) );
 
-	if (argc != 4) {
-		cerr << "Usage: " << argv[0] << " <IP to listen on> <num pucks (approx)> <world size>" << endl;
+	if (argc != 4 && argc != 5) {
+		cerr << "Usage: " << argv[0] << " <IP to listen on> <num pucks (approx)> <world size> [vision cells per range, 0 = auto]" << endl;
 		return -1;
 	}
 
 	host = string(argv[1]);
 	num_pucks = atof(argv[2]);
 	world_size = atof(argv[3]);
+	if (argc == 5)
+		vision_cells_per_range = atof(argv[4]);
 
 #ifndef NDEBUG
 	cout << endl;
@@ -699,6 +748,9 @@ main(int argc, char **argv) {
 			cout << "Operator sent shutdown signal. Shutting down..." << endl;
 			shutting_down = true;
 			antix::send_blank(&operators_socket);
+#if NEIGHBOUR_SYNC
+			send_stop_turn(&publish_socket);
+#endif
 		}
 
 		// message from gui
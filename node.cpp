@@ -8,7 +8,13 @@
 	https://github.com/imatix/zguide/blob/master/examples/C++/psenvsub.cpp
 */
 
+#define IS_NODE
+
+#include <map>
+#include <sstream>
+#include <dlfcn.h>
 #include "map.cpp"
+#include "controller.cpp"
 
 using namespace std;
 
@@ -54,6 +60,17 @@ antixtransfer::done done_msg;
 set<int> clients_done;
 // used for wait_for_next_turn()
 antixtransfer::done master_done_msg;
+// by team: control period the team's client asked for
+map<int, int> team_control_period;
+
+#if CLIENT_DEADLINE_MS
+// by team: turn we last sent the team its sense data, and the last turn it
+// was done by the deadline
+map<int, int> team_sensed_turn;
+map<int, int> team_done_turn;
+// by team: turns it was not done by the deadline
+map<int, int> team_misses;
+#endif
 
 // Connect to master & identify ourselves. Get state
 zmq::socket_t *master_req_sock;
@@ -76,6 +93,35 @@ zmq::socket_t *sync_pub_sock;
 // gui requests entities on this sock
 zmq::socket_t *gui_rep_sock;
 
+#if TREE_BARRIER
+// nodes below us in the barrier tree push their done messages to this sock
+zmq::socket_t *barrier_pull_sock;
+// we push ours to our parent on this sock. NULL if we report to master
+zmq::socket_t *barrier_push_sock;
+int barrier_children;
+// used in wait_for_next_turn_tree()
+antixtransfer::done barrier_child_msg;
+antixtransfer::done barrier_done_msg;
+map<int, int> barrier_scores;
+#endif
+
+/*
+	Optional: run a trusted AI library's controllers in the node itself,
+	instead of in client processes. No sense or control messages are then
+	built, and each team's robots are handed to the library in place
+*/
+bool local_controllers = false;
+int local_robots_per_team;
+Controller *local_ctlr;
+batch_controller_t local_batch_controller;
+// kept to free local_ctlr & close the library at shutdown
+void *local_ai_handle;
+void (*local_destroy)(Controller *);
+// indexed by team
+vector<Home *> team_homes;
+vector<ControllerBatch> local_batches;
+vector<vector<Robot *> > local_batch_robots;
+
 /*
 	Wait until we hear from total_teams unique client connections
 	Add their data to pb_init_msg
@@ -92,6 +138,12 @@ wait_on_initial_clients(antixtransfer::connect_init_node *pb_init_msg) {
 		// haven't yet heard
 		if (heard_clients.count( init_client.id() ) == 0) {
 			heard_clients.insert( init_client.id() );
+			team_control_period[ init_client.id() ] = init_client.control_period();
+#if CLIENT_DEADLINE_MS
+			team_sensed_turn[ init_client.id() ] = -1;
+			team_done_turn[ init_client.id() ] = -1;
+			team_misses[ init_client.id() ] = 0;
+#endif
 			antixtransfer::connect_init_node::Team *team = pb_init_msg->add_team();
 			team->set_id( init_client.id() );
 			team->set_num_robots( init_client.num_robots() );
@@ -228,19 +280,43 @@ handle_move_request(antixtransfer::move_bot *move_bot_msg) {
 		r->sensor_bbox.x.max = move_bot_msg->robot(i).bbox_x_max();
 		r->sensor_bbox.y.min = move_bot_msg->robot(i).bbox_y_min();
 		r->sensor_bbox.y.max = move_bot_msg->robot(i).bbox_y_max();
+		r->collided = move_bot_msg->robot(i).collided();
+
+		if (move_bot_msg->robot(i).command() != antixtransfer::control_message::SPEED) {
+			r->resume_command(move_bot_msg->robot(i).command(), move_bot_msg->robot(i).cruise_v(),
+				move_bot_msg->robot(i).target_x(), move_bot_msg->robot(i).target_y(),
+				move_bot_msg->robot(i).target_a(), move_bot_msg->robot(i).command_turns());
+		}
 
+#if !CLIENT_MEMORY
 		int ints_size = move_bot_msg->robot(i).ints_size();
 		for (int j = 0; j < ints_size; j++)
 			r->ints.push_back( move_bot_msg->robot(i).ints(j) );
 		int doubles_size = move_bot_msg->robot(i).doubles_size();
 		for (int j = 0; j < doubles_size; j++)
 			r->doubles.push_back( move_bot_msg->robot(i).doubles(j) );
+#endif
 	}
 #if DEBUG
 	cout << i+1 << " robots in move message." << endl;
 #endif
 }
 
+#if NEIGHBOUR_SYNC
+// turn to stop after, once master or a neighbour has told us
+int stop_turn = -1;
+
+/*
+	Neighbours must stop after the same turn, so each handshake message
+	carries our stop turn and we take the later of a neighbour's and ours
+*/
+void
+hear_stop_turn(const antixtransfer::SendMap *msg) {
+	if (msg->stop_turn() > stop_turn)
+		stop_turn = msg->stop_turn();
+}
+#endif
+
 /*
 	Do the handshake with both of our neighbours to agree on the state
 	of the critical sections (those sections within sight distance of border).
@@ -270,6 +346,12 @@ neighbours_handshake() {
 	// Ask our left neighbour to send us its robots in its right critical section
 	antix::send_blank(left_req_sock);
 
+#if SPECULATIVE_BORDER
+	// Move our left critical region robots while we wait, guessing what the
+	// left neighbour will send
+	my_map->speculate_left_crit_region();
+#endif
+
 	// Now we wait for the response from our left neighbour, and for requests
 	// from our right neighbour asking its left neighbour (us)
 	zmq::pollitem_t items [] = {
@@ -291,12 +373,22 @@ neighbours_handshake() {
 			// right critical section
 			if (left_responses_heard == 0) {
 				antix::recv_pb(left_req_sock, &sendmap_recv, 0);
+#if NEIGHBOUR_SYNC
+				hear_stop_turn(&sendmap_recv);
+#endif
+#if SPECULATIVE_BORDER
+				my_map->resolve_left_crit_region(&sendmap_recv, &move_bot_msg, &crit_map);
+#else
 				my_map->update_left_crit_region(&sendmap_recv, &move_bot_msg, &crit_map);
+#endif
 
 				// Initiate new request
 				// Send move message
 				antix::send_pb_flags(left_req_sock, &move_bot_msg, ZMQ_SNDMORE);
 				// And send the robots in our left critical section
+#if NEIGHBOUR_SYNC
+				crit_map.set_stop_turn(stop_turn);
+#endif
 				antix::send_pb_flags(left_req_sock, &crit_map, 0);
 			}
 
@@ -307,10 +399,16 @@ neighbours_handshake() {
 				antix::recv_pb(left_req_sock, &move_bot_msg, 0);
 				// and robot positions in its right critical section
 				antix::recv_pb(left_req_sock, &crit_map, 0);
+#if NEIGHBOUR_SYNC
+				hear_stop_turn(&crit_map);
+#endif
 
 				handle_move_request(&move_bot_msg);
 				//cout << "Add critical region robots in left neighbour response" << endl;
 				my_map->add_critical_region_robots(&crit_map);
+#if SPECULATIVE_BORDER
+				my_map->record_left_ghosts(&crit_map);
+#endif
 			}
 
 			else {
@@ -327,6 +425,9 @@ neighbours_handshake() {
 			if (right_requests_heard == 0) {
 				antix::recv_blank(neighbour_rep_sock);
 				my_map->build_right_crit_map(&crit_map);
+#if NEIGHBOUR_SYNC
+				crit_map.set_stop_turn(stop_turn);
+#endif
 				antix::send_pb_flags(neighbour_rep_sock, &crit_map, 0);
 			}
 
@@ -336,6 +437,9 @@ neighbours_handshake() {
 			else if (right_requests_heard == 1) {
 				antix::recv_pb(neighbour_rep_sock, &move_bot_msg, 0);
 				antix::recv_pb(neighbour_rep_sock, &crit_map, 0);
+#if NEIGHBOUR_SYNC
+				hear_stop_turn(&crit_map);
+#endif
 
 				handle_move_request(&move_bot_msg);
 				//cout << "Add critical region robots in right neighbour request" << endl;
@@ -347,6 +451,9 @@ neighbours_handshake() {
 				// Respond by sending a list of all the robots in our right crit region
 				// and our bots to move to that node
 				antix::send_pb_flags(neighbour_rep_sock, &move_bot_msg, ZMQ_SNDMORE);
+#if NEIGHBOUR_SYNC
+				crit_map.set_stop_turn(stop_turn);
+#endif
 				antix::send_pb_flags(neighbour_rep_sock, &crit_map, 0);
 			}
 
@@ -359,18 +466,44 @@ neighbours_handshake() {
 	}
 }
 
+/*
+	Start the motion primitive a controller asked for, if any. A primitive
+	needs a positive speed: it would never get anywhere otherwise
+*/
+void
+start_command(Robot *r, const int command, const double v, const double target_x, const double target_y, const double target_a) {
+	if (command == antixtransfer::control_message::SPEED) {
+		r->command = antixtransfer::control_message::SPEED;
+		return;
+	}
+	if (v <= 0) {
+		cout << "Error: motion primitive with speed " << v << " for robot " << r->id << " team " << r->team << " ignored" << endl;
+		r->command = antixtransfer::control_message::SPEED;
+		return;
+	}
+	r->set_command(command, v, target_x, target_y, target_a);
+}
+
 /*
 	For each robot in the message from a client, apply the action
+
+	A late message (CLIENT_DEADLINE_MS) was decided on an earlier turn's sense
+	data: its puck actions are dropped, and robots that have since left us
+	are skipped
 */
 void
-parse_client_message(antixtransfer::control_message *msg) {
+parse_client_message(antixtransfer::control_message *msg, const bool late = false) {
 	Robot *r;
 	int robot_size = msg->robot_size();
 	for (int i = 0; i < robot_size; i++) {
 		r = my_map->find_robot(msg->team(), msg->robot(i).id());
+		if (late && r == NULL)
+			continue;
 		assert(r != NULL);
 
-		if (msg->robot(i).puck_action() == antixtransfer::control_message::PICKUP) {
+		if (late) {
+			// no puck action
+		} else if (msg->robot(i).puck_action() == antixtransfer::control_message::PICKUP) {
 			r->pickup(&my_map->pucks);
 #if DEBUG
 			cout << "(PICKUP) Got last x " << r->last_x << " and last y " << r->last_y << " from client on turn " << antix::turn << endl;
@@ -382,7 +515,15 @@ parse_client_message(antixtransfer::control_message *msg) {
 #endif
 		}
 
+		// A motion primitive, which we carry out from now on
+		start_command(r, msg->robot(i).command(), msg->robot(i).v(),
+			msg->robot(i).target_x(), msg->robot(i).target_y(), msg->robot(i).target_a());
+
 		// Always set speed
+#if CLIENT_MEMORY
+		// Client keeps the robot's memory, so nothing more to record
+		r->setspeed(msg->robot(i).v(), msg->robot(i).w());
+#else
 		r->setspeed(msg->robot(i).v(), msg->robot(i).w(), msg->robot(i).last_x(), msg->robot(i).last_y());
 #if DEBUG
 		cout << "(SETSPEED) Got last x " << r->last_x << " and last y " << r->last_y << " from client on turn " << antix::turn << endl;
@@ -397,6 +538,7 @@ parse_client_message(antixtransfer::control_message *msg) {
 		int doubles_size = msg->robot(i).doubles_size();
 		for (int j = 0; j < doubles_size; j++)
 			r->doubles.push_back( msg->robot(i).doubles(j) );
+#endif
 	}
 }
 
@@ -414,11 +556,16 @@ service_control_messages() {
 	// message will have 0 robots in it to differentiate between them
 
 	// The number of messages we expect is:
-	// - sense_messages: N = # of clients in the world
+	// - sense_messages: N = # of clients in the world controlled this turn
 	// - control messages: M = # of teams we are currently holding robots for
 	//   - we know this through sense_map.size()
 	int rc;
-	int expected_messages = total_teams + my_map->sense_map.size();
+	int due_teams = 0;
+	for (map<int, int>::const_iterator it = team_control_period.begin(); it != team_control_period.end(); it++) {
+		if (my_map->team_due(it->first))
+			due_teams++;
+	}
+	int expected_messages = due_teams + my_map->sense_map.size();
 	for (int i = 0; i < expected_messages; i++) {
 		rc = antix::recv_pb(control_rep_sock, &control_msg, 0);
 		assert(rc == 1);
@@ -521,6 +668,107 @@ wait_for_clients() {
 #endif
 }
 
+#if CLIENT_DEADLINE_MS
+/*
+	In place of service_control_messages() and wait_for_clients(): serve
+	sense requests, commands and done messages from clients in whatever order
+	they come, until every team is done this turn or CLIENT_DEADLINE_MS passes
+
+	A team is done this turn if it sent done after getting this turn's sense
+	data. Anything a late team sends is handled when it arrives, in a later
+	turn. Its robots keep their v/w until then
+*/
+void
+service_clients_deadline() {
+#if DEBUG_SYNC
+	cout << "Sync: Serving clients until all are done or deadline..." << endl;
+#endif
+	const long deadline = antix::now_ms() + CLIENT_DEADLINE_MS;
+	int teams_done = 0;
+
+	zmq::pollitem_t items [] = {
+		{ *control_rep_sock, 0, ZMQ_POLLIN, 0 },
+		{ *sync_rep_sock, 0, ZMQ_POLLIN, 0 }
+	};
+
+	int rc;
+	while (teams_done < total_teams) {
+		const long remaining = deadline - antix::now_ms();
+		if (remaining <= 0)
+			break;
+		// timeout is in microseconds
+		zmq::poll(&items [0], 2, remaining * 1000);
+
+		if (items[0].revents & ZMQ_POLLIN) {
+			rc = antix::recv_pb(control_rep_sock, &control_msg, 0);
+			assert(rc == 1);
+
+			// commands
+			if (control_msg.robot_size() > 0) {
+				const bool late = team_sensed_turn[ control_msg.team() ] != antix::turn;
+				parse_client_message(&control_msg, late);
+				antix::send_blank(control_rep_sock);
+
+			// sense request
+			} else {
+				team_sensed_turn[ control_msg.team() ] = antix::turn;
+				if (my_map->sense_map.count( control_msg.team() ) > 0)
+					antix::send_pb(control_rep_sock, my_map->sense_map[control_msg.team()]);
+				else
+					antix::send_pb(control_rep_sock, &blank_sense_msg);
+			}
+		}
+
+		if (items[1].revents & ZMQ_POLLIN) {
+			antix::recv_str(sync_rep_sock);
+			rc = antix::recv_pb(sync_rep_sock, &done_msg, 0);
+			assert(rc == 1);
+			antix::send_blank(sync_rep_sock);
+
+			// teams not controlled this turn send no sense request
+			const int team = done_msg.my_id();
+			const bool sensed = team_sensed_turn[team] == antix::turn || !my_map->team_due(team);
+			if (sensed && team_done_turn[team] != antix::turn) {
+				team_done_turn[team] = antix::turn;
+				teams_done++;
+			}
+		}
+	}
+
+	if (teams_done == total_teams)
+		return;
+
+	for (map<int, int>::iterator it = team_misses.begin(); it != team_misses.end(); it++) {
+		if (team_done_turn[it->first] == antix::turn)
+			continue;
+		it->second++;
+#if SENSE_DELTA
+		// it may not have had this turn's sense data, which the next is relative to
+		if (team_sensed_turn[it->first] != antix::turn && my_map->team_due(it->first))
+			my_map->keyframe_teams.insert(it->first);
+#endif
+	}
+}
+
+/*
+	List the teams that have missed the client deadline
+*/
+void
+print_deadline_misses() {
+	bool first = true;
+	for (map<int, int>::const_iterator it = team_misses.begin(); it != team_misses.end(); it++) {
+		if (it->second == 0)
+			continue;
+		if (first)
+			cout << "Turn " << antix::turn << ": client deadline misses (team: turns):";
+		first = false;
+		cout << " " << it->first << ": " << it->second;
+	}
+	if (!first)
+		cout << endl;
+}
+#endif
+
 /*
 	Every TURNS_SEND_SCORE turns, add all of our recorded scores for teams to
 	our done message before we send it
@@ -546,6 +794,286 @@ update_scores_to_send(antixtransfer::done *done_msg) {
 	}
 }
 
+/*
+	Load the AI library to run our robots' controllers with
+*/
+void
+load_local_controllers(string ai_library) {
+	// If non absolute path, assume cwd for AI.so path
+	if (ai_library[0] != '/')
+		ai_library = "./" + ai_library;
+
+	local_ai_handle = dlopen(ai_library.c_str(), RTLD_NOW | RTLD_GLOBAL);
+	if (local_ai_handle == NULL) {
+		cerr << "Error: could not load AI library: " << dlerror() << endl;
+		exit(-1);
+	}
+	Controller* (*create)();
+	create = (Controller* (*)())dlsym(local_ai_handle, "create_object");
+	local_destroy = (void (*)(Controller*))dlsym(local_ai_handle, "destroy_object");
+	local_ctlr = (Controller*) create();
+	local_batch_controller = (batch_controller_t) dlsym(local_ai_handle, "batch_controller");
+	if (local_batch_controller != NULL)
+		cout << "AI library has a batch controller." << endl;
+	local_controllers = true;
+}
+
+/*
+	In place of waiting on clients: every node runs all total_teams teams,
+	each with local_robots_per_team robots
+*/
+void
+local_initial_teams(antixtransfer::connect_init_node *pb_init_msg) {
+	for (int i = 0; i < total_teams; i++) {
+		antixtransfer::connect_init_node::Team *team = pb_init_msg->add_team();
+		team->set_id(i);
+		team->set_num_robots(local_robots_per_team);
+	}
+	cout << "Start up: Running controllers for " << total_teams << " teams in node." << endl;
+}
+
+/*
+	Once we know the homes, give the controllers theirs
+*/
+void
+local_initial_homes(antixtransfer::Node_list *node_list) {
+	local_ctlr->set_static_vars(antix::world_size, Robot::pickup_range);
+
+	team_homes.assign(total_teams, NULL);
+	for (int i = 0; i < node_list->home_size(); i++) {
+		const int team = node_list->home(i).team();
+		assert(team >= 0 && team < total_teams);
+		team_homes[team] = new Home( node_list->home(i).x(), node_list->home(i).y(), antix::home_radius, team );
+	}
+	local_batches.resize(total_teams);
+	local_batch_robots.resize(total_teams);
+}
+
+/*
+	Run the controller for each of our robots, and apply its decisions as
+	parse_client_message() does for a client's message
+
+	The batch points straight at each robot's memory, so it is updated in
+	place. Note robots' memory is only carried between nodes when it is kept
+	on the node, i.e. without CLIENT_MEMORY
+*/
+void
+run_local_controllers() {
+	for (int t = 0; t < total_teams; t++) {
+		local_batches[t].clear();
+		local_batches[t].home = team_homes[t];
+		local_batch_robots[t].clear();
+	}
+
+	vector<Robot *>::const_iterator robots_end = my_map->robots.end();
+	for (vector<Robot *>::const_iterator it = my_map->robots.begin(); it != robots_end; it++) {
+		Robot *r = *it;
+		// being driven by a motion primitive
+		if (r->command != antixtransfer::control_message::SPEED)
+			continue;
+		ControllerBatch *b = &local_batches[r->team];
+		b->add_robot(r->id, r->x, r->y, r->a, r->has_puck, r->collided,
+			r->last_x, r->last_y, &r->ints, &r->doubles);
+		r->collided = false;
+
+		vector<SeePuck>::const_iterator see_pucks_end = r->see_pucks.end();
+		for (vector<SeePuck>::const_iterator it2 = r->see_pucks.begin(); it2 != see_pucks_end; it2++)
+			b->add_seen_puck(it2->puck->held, it2->range, it2->bearing);
+
+		local_batch_robots[r->team].push_back(r);
+	}
+
+	for (int t = 0; t < total_teams; t++) {
+		ControllerBatch *b = &local_batches[t];
+		if (b->size == 0)
+			continue;
+
+		if (local_batch_controller != NULL)
+			local_batch_controller(local_ctlr, b);
+		else
+			run_controller_per_robot(local_ctlr, b);
+
+		for (int i = 0; i < b->size; i++) {
+			Robot *r = local_batch_robots[t][i];
+
+			if (b->puck_action[i] == PUCK_ACTION_PICKUP)
+				r->pickup(&my_map->pucks);
+			else if (b->puck_action[i] == PUCK_ACTION_DROP)
+				r->drop(&my_map->pucks, &my_map->local_homes);
+
+			start_command(r, b->command[i], b->v[i], b->target_x[i], b->target_y[i], b->target_a[i]);
+			r->setspeed(b->v[i], b->w[i], b->last_x[i], b->last_y[i]);
+		}
+	}
+}
+
+#if TREE_BARRIER
+/*
+	Port that the node with the given neighbour port takes done messages on
+*/
+string
+barrier_port(const string &neighbour_port) {
+	stringstream ss;
+	ss << atoi(neighbour_port.c_str()) + BARRIER_PORT_OFFSET;
+	return ss.str();
+}
+
+/*
+	Place ourselves in the barrier tree: node i's parent is node
+	(i - 1) / BARRIER_FANOUT, and node 0 reports to master
+	Bind for our children and connect to our parent
+*/
+void
+setup_barrier(zmq::context_t *context) {
+	const int num_nodes = node_list.node_size();
+	const int first_child = my_id * BARRIER_FANOUT + 1;
+	barrier_children = 0;
+	for (int c = first_child; c < first_child + BARRIER_FANOUT && c < num_nodes; c++)
+		barrier_children++;
+
+	barrier_pull_sock = NULL;
+	if (barrier_children > 0) {
+		while (1) {
+			try {
+				barrier_pull_sock = new zmq::socket_t(*context, ZMQ_PULL);
+			} catch (zmq::error_t e) {
+				cout << "Error: Barrier pull sock new: " << e.what() << endl;
+				delete barrier_pull_sock;
+				antix::sleep(1000);
+				continue;
+			}
+			break;
+		}
+		while (1) {
+			try {
+				barrier_pull_sock->bind(antix::make_endpoint(my_ip, barrier_port(my_neighbour_port)));
+			} catch (zmq::error_t e) {
+				cout << "Error: Barrier pull sock bind: " << e.what() << endl;
+				antix::sleep(1000);
+				continue;
+			}
+			break;
+		}
+	}
+
+	barrier_push_sock = NULL;
+	if (my_id > 0) {
+		const int parent_id = (my_id - 1) / BARRIER_FANOUT;
+		const antixtransfer::Node_list::Node *parent = NULL;
+		for (int i = 0; i < num_nodes; i++) {
+			if (node_list.node(i).id() == parent_id)
+				parent = &node_list.node(i);
+		}
+		assert(parent != NULL);
+
+		while (1) {
+			try {
+				barrier_push_sock = new zmq::socket_t(*context, ZMQ_PUSH);
+			} catch (zmq::error_t e) {
+				cout << "Error: Barrier push sock new: " << e.what() << endl;
+				delete barrier_push_sock;
+				antix::sleep(1000);
+				continue;
+			}
+			break;
+		}
+		while (1) {
+			try {
+				barrier_push_sock->connect(antix::make_endpoint(parent->ip_addr(), barrier_port(parent->neighbour_port())));
+			} catch (zmq::error_t e) {
+				cout << "Error: Barrier push sock connect: " << e.what() << endl;
+				antix::sleep(1000);
+				continue;
+			}
+			break;
+		}
+	}
+	cout << "Barrier tree: " << barrier_children << " children, ";
+	if (my_id > 0)
+		cout << "parent node " << (my_id - 1) / BARRIER_FANOUT << endl;
+	else
+		cout << "reporting to master" << endl;
+}
+
+/*
+	Wait for the nodes below us in the tree to be done, then pass one done
+	message for all of us up the tree (to master if we are the root), with
+	our scores combined by team
+	Then wait for master to begin the next turn
+*/
+string
+wait_for_next_turn_tree() {
+	barrier_done_msg.CopyFrom(master_done_msg);
+	int nodes = 1;
+
+	barrier_scores.clear();
+	for (int i = 0; i < master_done_msg.scores_size(); i++)
+		barrier_scores[ master_done_msg.scores(i).team_id() ] += master_done_msg.scores(i).score();
+
+	for (int i = 0; i < barrier_children; i++) {
+		string type = antix::recv_str(barrier_pull_sock);
+		assert(type == "done");
+		int rc = antix::recv_pb(barrier_pull_sock, &barrier_child_msg, 0);
+		assert(rc == 1);
+		nodes += barrier_child_msg.nodes();
+		for (int j = 0; j < barrier_child_msg.scores_size(); j++)
+			barrier_scores[ barrier_child_msg.scores(j).team_id() ] += barrier_child_msg.scores(j).score();
+	}
+
+	barrier_done_msg.set_nodes(nodes);
+	barrier_done_msg.clear_scores();
+	for (map<int, int>::const_iterator it = barrier_scores.begin(); it != barrier_scores.end(); it++) {
+		antixtransfer::done::Score *score = barrier_done_msg.add_scores();
+		score->set_team_id( it->first );
+		score->set_score( it->second );
+	}
+
+	if (barrier_push_sock == NULL)
+		return antix::wait_for_next_turn(master_req_sock, master_sub_sock, &barrier_done_msg);
+
+	antix::send_pb_envelope(barrier_push_sock, &barrier_done_msg, "done");
+	// begin still comes from master on our sub sock
+	return antix::recv_str(master_sub_sock);
+}
+#endif
+
+#if NEIGHBOUR_SYNC
+/*
+	Instead of waiting on master to begin the next turn: send master our
+	scores and turn when due, and check whether we have been told to stop
+	Our neighbours hold us back through the border handshake
+
+	The first node to hear of the stop, from master or a neighbour, stops
+	after a turn far enough ahead that every node hears of it through the
+	handshakes before reaching it. Any two nodes are at most num_nodes / 2
+	turns apart, and news travels a node a turn, so 2 * num_nodes is enough
+*/
+string
+neighbour_sync_next_turn() {
+	if (antix::turn % TURNS_SEND_SCORE == 0) {
+		master_done_msg.set_turn(antix::turn);
+		antix::send_pb_envelope(master_req_sock, &master_done_msg, "done");
+		antix::recv_blank(master_req_sock);
+	}
+
+	string type;
+	if (stop_turn < 0 && antix::recv_str(master_sub_sock, &type, ZMQ_NOBLOCK) == 1) {
+		assert(type == "s");
+		antixtransfer::stop stop_msg;
+		int rc = antix::recv_pb(master_sub_sock, &stop_msg, 0);
+		assert(rc == 1);
+		stop_turn = max( stop_msg.turn(), antix::turn + 2 * node_list.node_size() + 2 );
+		cout << "Master says stop: stopping after turn " << stop_turn << " (now on turn " << antix::turn << ")" << endl;
+	}
+	// the stop turn is agreed before any node reaches it
+	assert(stop_turn < 0 || antix::turn <= stop_turn);
+
+	if (stop_turn >= 0 && antix::turn >= stop_turn)
+		return "s";
+	return "b";
+}
+#endif
+
 /*
 	Send message to clients to begin next turn
 */
@@ -561,8 +1089,10 @@ main(int argc, char **argv) {
 	srand( time(NULL) );
 	srand48( time(NULL) );
 	
-	if (argc != 7) {
-		cerr << "Usage: " << argv[0] << " <IP of master> <IP to listen on> <neighbour port> <GUI port> <IPC ID # (unique to this computer)> <number of teams>" << endl;
+	if (argc != 7 && argc != 9) {
+		cerr << "Usage: " << argv[0] << " <IP of master> <IP to listen on> <neighbour port> <GUI port> <IPC ID # (unique to this computer)> <number of teams> [<# of robots per team> <AI library.so>]" << endl;
+		cerr << "Given the last two, robots are controlled in the node and no clients are used." << endl;
+		cerr << "Controllers run in the node are given the pucks their robots see, but no robots." << endl;
 		return -1;
 	}
 
@@ -573,6 +1103,11 @@ main(int argc, char **argv) {
 	ipc_id = string(argv[5]);
 	total_teams = atoi(argv[6]);
 	assert(total_teams > 0);
+	if (argc == 9) {
+		local_robots_per_team = atoi(argv[7]);
+		assert(local_robots_per_team > 0);
+		load_local_controllers(string(argv[8]));
+	}
 
 	// socket to announce ourselves to master on
 	while (1) {
@@ -703,19 +1238,23 @@ main(int argc, char **argv) {
 		break;
 	}
 
-	cout << "Waiting for connection from " << total_teams << " teams." << endl;
-
 	// Build message we will send to master
 	antixtransfer::connect_init_node pb_init_msg;
 	pb_init_msg.set_ip_addr(my_ip);
 	pb_init_msg.set_neighbour_port(my_neighbour_port);
 	pb_init_msg.set_gui_port(my_gui_port);
 
-	// this message also includes data on our teams: wait for teams to connect & set this
-	wait_on_initial_clients(&pb_init_msg);
+	if (local_controllers) {
+		local_initial_teams(&pb_init_msg);
+	} else {
+		cout << "Waiting for connection from " << total_teams << " teams." << endl;
+
+		// this message also includes data on our teams: wait for teams to connect & set this
+		wait_on_initial_clients(&pb_init_msg);
 
-	// Make sure all clients can hear messages on our PUB sock before continuing
-	synchronise_clients();
+		// Make sure all clients can hear messages on our PUB sock before continuing
+		synchronise_clients();
+	}
 
 	// Now we connect to master & send our initialization data
 	// In response we get simulation parameters, node list, home list,
@@ -738,6 +1277,7 @@ main(int argc, char **argv) {
 	Robot::robot_radius = init_response.robot_radius();
 	Robot::fov = init_response.fov();
 	Robot::pickup_range = init_response.pickup_range();
+	const double vision_cells_per_range = init_response.vision_cells_per_range();
 
 	cout << "We are now node ID " << my_id << endl;
 
@@ -776,17 +1316,23 @@ main(int argc, char **argv) {
 
 	// Now that we have simulation params & home locations, pass them on to our
 	// local clients
-	initial_begin_clients(&init_response, &node_list);
+	if (local_controllers)
+		local_initial_homes(&node_list);
+	else
+		initial_begin_clients(&init_response, &node_list);
 
 	// calculate our min / max x from the offset assigned to us in node_list
 	antix::offset_size = antix::world_size / node_list.node_size();
 
 	//antix::matrix_height = ceil(antix::world_size / Robot::vision_range);
-	antix::matrix_height = floor(antix::world_size / Robot::vision_range);
+	antix::set_vision_grid( Map::matrix_height_for( vision_cells_per_range > 0 ? vision_cells_per_range : 1 ) );
 	//antix::matrix_width = ceil(antix::offset_size / Robot::vision_range);
 
 	// Initialize map object
 	my_map = new Map( find_map_offset(&node_list), &node_list, initial_puck_amount, my_id);
+	my_map->control_periods = team_control_period;
+	if (vision_cells_per_range <= 0)
+		my_map->calibrate_matrix();
 	antix::matrix_left_x_col = antix::Cell_x(antix::my_min_x);
 	antix::matrix_right_x_col = antix::Cell_x(antix::my_min_x + antix::offset_size);
 	antix::matrix_right_world_x_col = antix::Cell_x(antix::world_size);
@@ -894,29 +1440,56 @@ main(int argc, char **argv) {
 		break;
 	}
 
+#if TREE_BARRIER
+	setup_barrier(&context);
+#endif
+
 	// response from master (sync message)
 	string response;
 
 	// enter main loop
 	while (1) {
+#if SPATIAL_REORDER_TURNS
+		if (antix::turn % SPATIAL_REORDER_TURNS == 0)
+			my_map->spatial_reorder();
+#endif
+
 		// update scores: decrement lifetimes, assign scores + respawn pucks if nec
 		my_map->update_scores();
 
+		// set v/w for robots on motion primitives
+		my_map->run_commands();
+
 		// update poses for internal robots
 		my_map->update_poses();
 
 		// Exchange robots/pucks on border, and agree on collisions near borders
 		neighbours_handshake();
 
-		// build message for each client of what their robots can see
-		my_map->build_sense_messages();
+		// robots on motion primitives that collided go back to their clients
+		my_map->end_collided_commands();
+
+		if (local_controllers) {
+			// find what our robots can see, and decide for them here
+			my_map->update_see_pucks();
+			run_local_controllers();
+		} else {
+			// build message for each client of what their robots can see
+			my_map->build_sense_messages();
+		}
 		
 #if DEBUG
 		my_map->print_local_robots();
 #endif
 
 		// service control messages on our REP socket
-		service_control_messages();
+#if CLIENT_DEADLINE_MS
+		if (!local_controllers)
+			service_clients_deadline();
+#else
+		if (!local_controllers)
+			service_control_messages();
+#endif
 
 		// service GUI entity requests
 #if GUI
@@ -924,14 +1497,27 @@ main(int argc, char **argv) {
 #endif
 
 		// wait for all clients to be done
-		wait_for_clients();
+#if CLIENT_DEADLINE_MS
+		// (done above, up to the deadline)
+		if (antix::turn % TURNS_SEND_SCORE == 0)
+			print_deadline_misses();
+#else
+		if (!local_controllers)
+			wait_for_clients();
+#endif
 
 #if DEBUG_SYNC
 		cout << "Sync: Sending done to master & awaiting response..." << endl;
 #endif
 		// tell master we're done the work for this turn & wait for signal
 		update_scores_to_send(&master_done_msg);
+#if TREE_BARRIER
+		string response = wait_for_next_turn_tree();
+#elif NEIGHBOUR_SYNC
+		string response = neighbour_sync_next_turn();
+#else
 		string response = antix::wait_for_next_turn(master_req_sock, master_sub_sock, &master_done_msg);
+#endif
 		if (response == "s")
 			// leave loop
 			break;
@@ -947,7 +1533,8 @@ main(int argc, char **argv) {
 #endif
 
 		// tell clients to begin
-		begin_clients();
+		if (!local_controllers)
+			begin_clients();
 
 		antix::turn++;
 #if DEBUG
@@ -960,11 +1547,25 @@ main(int argc, char **argv) {
 	}
 
 	cout << "Received shutdown message from master. Shutting down..." << endl;
+#if SPECULATIVE_BORDER
+	cout << "Speculative border: guessed right " << my_map->spec_hits << " turns, wrong ";
+	cout << my_map->spec_misses << " turns (" << my_map->spec_redone << " robot updates redone)" << endl;
+#endif
+#if SENSE_NEIGHBOUR_LISTS
+	cout << "Sense neighbour lists built " << my_map->neighbour_list_builds << " times in " << antix::turn << " turns" << endl;
+#endif
 	cout << "Sending shutdown message to our clients..." << endl;
 	antix::send_str(sync_pub_sock, "s");
 
 	delete my_map;
 
+	for (vector<Home *>::iterator it = team_homes.begin(); it != team_homes.end(); it++)
+		delete *it;
+	if (local_controllers) {
+		local_destroy(local_ctlr);
+		dlclose(local_ai_handle);
+	}
+
 	delete master_req_sock;
 	delete master_sub_sock;
 	delete right_req_sock;
@@ -974,6 +1575,11 @@ main(int argc, char **argv) {
 	delete sync_rep_sock;
 	delete sync_pub_sock;
 	delete gui_rep_sock;
+#if TREE_BARRIER
+	// NULL where this node has no children / parent
+	delete barrier_pull_sock;
+	delete barrier_push_sock;
+#endif
 
 	google::protobuf::ShutdownProtobufLibrary();
 	return 0;
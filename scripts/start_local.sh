@@ -2,12 +2,15 @@
 #
 # Start a simulation using only the local machine
 #
-# Usage: ./start_local.sh <number of nodes> <number of teams> <robots per team>
+# Usage: ./start_local.sh <number of nodes> <number of teams> <robots per team> <AI library.so> [single]
+#
+# Given "single", each team gets one client process controlling its robots on
+# all (local IPC) nodes, rather than one client per node
 #
 
-if [ $# -ne 4 ]
+if [ $# -ne 4 ] && [ $# -ne 5 ]
 then
-	echo "Usage: $0 <number of nodes> <number of teams> <robots per team> <AI library.so>"
+	echo "Usage: $0 <number of nodes> <number of teams> <robots per team> <AI library.so> [single]"
 	exit -1
 fi
 
@@ -15,6 +18,7 @@ NUM_NODES=$1
 NUM_TEAMS=$2
 ROBOTS_PER_TEAM=$3
 AI_LIBRARY=$4
+SINGLE_CLIENT=$5
 
 echo "Removing /tmp/$USER-node* ..."
 rm -f /tmp/$USER-node*
@@ -32,9 +36,26 @@ done
 
 # Then clients/teams
 rm -f ~/clients.local.log
+# comma separated list of every node's IPC id
+ALL_NODES=0
+node=1
+while [ $node -lt $NUM_NODES ]
+do
+	ALL_NODES="$ALL_NODES,$node"
+	node=`expr $node + 1`
+done
+
 i=0
 while [ $i -lt $NUM_TEAMS ]
 do
+	if [ "$SINGLE_CLIENT" = "single" ]
+	then
+		# <#robots> <team id> <node IPC ids>
+		./client $ROBOTS_PER_TEAM $i $ALL_NODES $AI_LIBRARY &>> ~/clients.local.log &
+		i=`expr $i + 1`
+		continue
+	fi
+
 	# Create one client process for each node
 	node=0
 	while [ $node -lt $NUM_NODES ]
@@ -0,0 +1,80 @@
+/*
+	Compare antix::propose_poses() against antix::propose_pose() robot by
+	robot, and time the two. Now & then a robot gets speeds over a world /
+	turn so the batch has poses to redo
+*/
+
+#include "antix.cpp"
+#include <sys/time.h>
+
+using namespace std;
+
+// as set by the master
+#define MAX_V 0.005
+#define MAX_W 0.1
+
+// most the two may differ by (the compiler may fuse multiply-adds in one)
+#define TOLERANCE 1e-9
+
+double
+seconds() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char **argv) {
+	if (argc != 4) {
+		cerr << "Usage: " << argv[0] << " <number of robots> <runs> <world size>" << endl;
+		return -1;
+	}
+	const int num_robots = atoi(argv[1]);
+	const int runs = atoi(argv[2]);
+	antix::world_size = atof(argv[3]);
+	srand48( 1 );
+
+	vector<double> x(num_robots), y(num_robots), a(num_robots), v(num_robots), w(num_robots);
+	vector<double> bx(num_robots), by(num_robots), ba(num_robots);
+	vector<double> sx(num_robots), sy(num_robots), sa(num_robots);
+
+	double max_error = 0,
+		batch_time = 0,
+		scalar_time = 0;
+	for (int run = 0; run < runs; run++) {
+		for (int i = 0; i < num_robots; i++) {
+			x[i] = antix::rand_between(0, antix::world_size);
+			y[i] = antix::rand_between(0, antix::world_size);
+			a[i] = antix::rand_between(-M_PI, M_PI);
+			v[i] = antix::rand_between(-MAX_V, MAX_V);
+			w[i] = antix::rand_between(-MAX_W, MAX_W);
+			if (i % 1000 == 0) {
+				v[i] = antix::rand_between(-3, 3) * antix::world_size;
+				w[i] = antix::rand_between(-10, 10) * M_PI;
+			}
+		}
+
+		double start = seconds();
+		antix::propose_poses(num_robots, &x[0], &y[0], &a[0], &v[0], &w[0], &bx[0], &by[0], &ba[0]);
+		batch_time += seconds() - start;
+
+		start = seconds();
+		for (int i = 0; i < num_robots; i++)
+			antix::propose_pose<double>(x[i], y[i], a[i], v[i], w[i], sx[i], sy[i], sa[i]);
+		scalar_time += seconds() - start;
+
+		for (int i = 0; i < num_robots; i++) {
+			max_error = max(max_error, fabs( antix::WrapDistance(bx[i] - sx[i]) ));
+			max_error = max(max_error, fabs( antix::WrapDistance(by[i] - sy[i]) ));
+			max_error = max(max_error, fabs( antix::AngleNormalize(ba[i] - sa[i]) ));
+		}
+	}
+
+	cout << "Max difference: " << max_error << endl;
+	cout << "Batch: " << batch_time << "s, one by one: " << scalar_time << "s" << endl;
+	if (max_error > TOLERANCE) {
+		cout << "Difference over " << TOLERANCE << endl;
+		return 1;
+	}
+	return 0;
+}
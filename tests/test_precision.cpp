@@ -0,0 +1,77 @@
+/*
+	Compare robot poses integrated with float coordinates (FLOAT_COORDS)
+	against doubles over a long run. No collisions: robots wander with speeds
+	that change every so often, both versions getting the same speeds
+*/
+
+#include "antix.cpp"
+
+using namespace std;
+
+// how often robots get new speeds, and we print how far apart we are
+#define SPEED_TURNS 100
+#define REPORT_TURNS 1000
+
+// as set by the master
+#define VISION_RANGE 0.1
+#define MAX_V 0.005
+#define MAX_W 0.1
+
+int
+main(int argc, char **argv) {
+	if (argc != 4) {
+		cerr << "Usage: " << argv[0] << " <number of robots> <turns> <world size>" << endl;
+		return -1;
+	}
+	const int num_robots = atoi(argv[1]);
+	const int turns = atoi(argv[2]);
+	antix::world_size = atof(argv[3]);
+	srand48( 1 );
+
+	vector<double> xd(num_robots), yd(num_robots), ad(num_robots);
+	vector<float> xf(num_robots), yf(num_robots), af(num_robots);
+	vector<double> v(num_robots), w(num_robots);
+
+	for (int i = 0; i < num_robots; i++) {
+		xd[i] = xf[i] = antix::rand_between(0, antix::world_size);
+		yd[i] = yf[i] = antix::rand_between(0, antix::world_size);
+		ad[i] = af[i] = antix::rand_between(-M_PI, M_PI);
+	}
+
+	cout << "turn\tmax pos error\tmean pos error\tmax heading error\tin other vision cell" << endl;
+	for (int turn = 1; turn <= turns; turn++) {
+		if (turn % SPEED_TURNS == 1) {
+			for (int i = 0; i < num_robots; i++) {
+				v[i] = antix::rand_between(0, MAX_V);
+				w[i] = antix::rand_between(-MAX_W, MAX_W);
+			}
+		}
+
+		for (int i = 0; i < num_robots; i++) {
+			antix::propose_pose<double>(xd[i], yd[i], ad[i], v[i], w[i], xd[i], yd[i], ad[i]);
+			antix::propose_pose<float>(xf[i], yf[i], af[i], v[i], w[i], xf[i], yf[i], af[i]);
+		}
+
+		if (turn % REPORT_TURNS != 0 && turn != turns)
+			continue;
+
+		double max_error = 0,
+			total_error = 0,
+			max_heading_error = 0;
+		int other_cell = 0;
+		for (int i = 0; i < num_robots; i++) {
+			const double dx = antix::WrapDistance(xf[i] - xd[i]);
+			const double dy = antix::WrapDistance(yf[i] - yd[i]);
+			const double error = hypot(dx, dy);
+			max_error = max(max_error, error);
+			total_error += error;
+			max_heading_error = max(max_heading_error, fabs( antix::AngleNormalize(af[i] - ad[i]) ));
+			if ( floor(xf[i] / VISION_RANGE) != floor(xd[i] / VISION_RANGE)
+				|| floor(yf[i] / VISION_RANGE) != floor(yd[i] / VISION_RANGE) )
+				other_cell++;
+		}
+		cout << turn << "\t" << max_error << "\t" << total_error / num_robots << "\t"
+			<< max_heading_error << "\t" << other_cell << "/" << num_robots << endl;
+	}
+	return 0;
+}